@@ -16,10 +16,17 @@
  */
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <float.h>
 #include <R.h>
+#include <R_ext/Utils.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "tree.h"
 
 #ifdef ENABLE_NLS
 #include <libintl.h>
@@ -36,10 +43,13 @@ static double XLOGX(double x)
 #define True 1
 #define False 0
 #define EPS 1e-4
-#define NALEVEL -99999
+#define NALEVEL (-1073741824)
 #ifndef max
 # define max(a, b) ((a>b)?a:b)
 #endif
+#ifndef min
+# define min(a, b) ((a<b)?a:b)
+#endif
 
 #define DEBUG False
 #define Printf if (DEBUG) printf
@@ -51,85 +61,190 @@ static void scat(char *s, char c)
     s[i] = '\0';
 }
 
-static double *X, *y, *w, *dev, *yval, *yprob, mindev,  devtarget,
-    *tvar, *cprob, *scprob, *tyc, *w1;
-static int  nobs, nvar, minsize, mincut, nnode, nmax,*twhere, *ttw, *ty, Gini;
-static Sint *levels, *node, *var, *where, *ordered;
+/* scratch for the split search, one per thread */
+typedef struct Scratch {
+    double *tvar, *w1, *tyc, *tab, *cnt, *cprob, *scprob, *ys, *pc;
+    int *ty, *ind, *indl;
+} Scratch;
 
-static char **cutleft, **cutright;
-static int nc, *indl, *indr, *ind, exists, offset, maxnl;
-static double *yp;
-static double *tab, *cnt, *n, *ys;
+/* best split on one variable: val is its deviance including the cases
+   with the variable missing (DBL_MAX if none), cut the threshold of a
+   continuous variable, left[l] 1, 0 or -1 if level l goes left, right or
+   is absent from the node */
+typedef struct Split {
+    double val, cut;
+    int *left, gini_na;
+} Split;
 
+/* nodes with fewer cases times variables are searched serially */
+#define PARMIN 20000
 
-static void fillin_node(int inode)
+/* histogram engine: see the comments in tree.h */
+#define HNA 255
+#define HSLOT 256
+/* spare node histograms kept for reuse: two a level, at most 32 deep */
+#define HFREE (2 * 32 + 2)
+
+/* Working storage is calloc-ed and recorded in t->mem, so that it can
+   all be freed by tree_free() whether or not tree_grow() succeeded */
+static void *talloc(Tree *t, size_t nel, size_t sz)
 {
-    int     j, k, nl, yparent;
-    double  yl, sum, t, n1;
-    char   *labl, *labr;
+    void *p, **mem;
 
-    labl = (char *) S_alloc(100, sizeof(char));
-    labr = (char *) S_alloc(100, sizeof(char));
-    *labl = *labr = '\0';
-    cutleft[inode] = labl;
-    cutright[inode] = labr;
-    var[inode] = 0;
-    if (nc) {
+    if (t->nmem == t->amem) {
+	t->amem = t->amem ? 2 * t->amem : 64;
+	mem = (void **) realloc(t->mem, t->amem * sizeof(void *));
+	if (!mem) return NULL;
+	t->mem = mem;
+    }
+    p = calloc(nel > 0 ? nel : 1, sz);
+    if (p) t->mem[t->nmem++] = p;
+    return p;
+}
+
+/* realloc p, recorded in t->mem */
+static void *trealloc(Tree *t, void *p, size_t nel, size_t sz)
+{
+    int i;
+    void *q;
+
+    for (i = t->nmem - 1; i >= 0 && t->mem[i] != p; i--);
+    if (i < 0 || !(q = realloc(p, (nel > 0 ? nel : 1) * sz))) return NULL;
+    t->mem[i] = q;
+    return q;
+}
+
+/* free p now rather than in tree_free() */
+static void tfree(Tree *t, void *p)
+{
+    int i;
+
+    for (i = t->nmem - 1; i >= 0 && t->mem[i] != p; i--);
+    if (i < 0) return;
+    free(p);
+    t->mem[i] = t->mem[--t->nmem];
+}
+
+void tree_free(Tree *t)
+{
+    int i;
+
+    for (i = 0; i < t->nmem; i++) free(t->mem[i]);
+    free(t->mem);
+    t->mem = NULL;
+    t->nmem = t->amem = 0;
+    t->ready = False;
+}
+
+
+/* the level (from 0) of case j of factor iv, or -1 if missing */
+static int xlevel(Tree *t, int j, int iv)
+{
+    int c;
+    double v;
+
+    if (t->xcode && t->xcode[iv]) {
+	c = t->xcode[iv][j];
+	return (c == NA_INTEGER) ? -1 : c - 1;
+    }
+    v = t->xcol[iv][j];
+    return ISNA(v) ? -1 : (int) v - 1;
+}
+
+/* the value of case j of continuous variable iv, NA if missing */
+static double xnum(Tree *t, int j, int iv)
+{
+    float f;
+
+    if (t->xflt && t->xflt[iv]) {
+	f = t->xflt[iv][j];
+	return ISNAN(f) ? NA_REAL : (double) f;
+    }
+    return t->xcol[iv][j];
+}
+
+/* The cut between adjacent values a < b of variable iv: their mean, or
+   for a single-precision column the float nearest it if that lies
+   strictly between, so that comparisons of floats with the cut (and of
+   the doubles they came from) reproduce the split, and "%.9g" prints it
+   exactly */
+static double cut_between(Tree *t, int iv, double a, double b)
+{
+    double cut = 0.5 * (a + b);
+    float f;
+
+    if (t->xflt && t->xflt[iv]) {
+	f = (float) cut;
+	if (f > a && f < b) cut = f;
+    }
+    return cut;
+}
+
+/* The totals, fitted value and deviance of inode, whose parent is at
+   index parent (-1 for the root): ties in the fitted class go to the
+   parent's class */
+static void fillin_node(Tree *t, int inode, int parent)
+{
+    int     i, j, k, nl, yparent, b = t->nbeg[inode], e = t->nend[inode];
+    double  yl, sum, m, n1;
+
+    t->var[inode] = 0;
+    t->orig[inode] = -1;
+    if (t->nc) {
 	n1 = 0;
-	for (k = 0; k < nc; k++) yprob[nc * inode + k] = 0.0;
-	for (j = 0; j < nobs; j++)
-	    if (where[j] == inode) {
-		n1 += w[j];
-		yprob[nc * inode + (int) y[j]-1] += w[j];
-	    }
-	n[inode] = n1;
-	yparent = -1;
-	if (inode > 0) {
-	    for(j = 0; j < inode; j++) 
-		if(node[j] == node[inode]/2) yparent = (int)(y[j] - 1);
+	for (k = 0; k < t->nc; k++) t->yprob[t->nc * inode + k] = 0.0;
+	for (i = b; i < e; i++) {
+	    j = t->perm[i];
+	    n1 += t->w[j];
+	    t->yprob[t->nc * inode + (int) t->y[j]-1] += t->w[j];
 	}
+	t->n[inode] = n1;
+	yparent = (parent >= 0) ? (int) t->yval[parent] - 1 : -1;
 	nl = 0;
 	yl = -1.0;
-	for (k = 0; k < nc; k++) {
+	for (k = 0; k < t->nc; k++) {
 /*	 if (yprob[nc*inode + k] > yl) {
 	 nl = k;
 	 yl = yprob[nc * inode + k];
 	 } */
-	    if (yprob[nc*inode + k] >= yl) {
-		if (yprob[nc*inode + k] == yl) {
+	    if (t->yprob[t->nc*inode + k] >= yl) {
+		if (t->yprob[t->nc*inode + k] == yl) {
 		    if(k == yparent) nl = k;
 		} else {
 		    nl = k;
-		    yl = yprob[nc * inode + k];
+		    yl = t->yprob[t->nc * inode + k];
 		}
 	    }
-	    if (n1 > 0) yprob[nc * inode + k] /= n1;
-	    else yprob[nc * inode + k] = 1.0/nc;
+	    if (n1 > 0) t->yprob[t->nc * inode + k] /= n1;
+	    else t->yprob[t->nc * inode + k] = 1.0/t->nc;
 	}
 /*for(k = 0; k < nc; k++) Printf(" %g", yprob[nc * inode + k]); Printf("\n");*/
 	nl++;
-	if(inode >= exists + offset) yval[inode] = nl;
+	if(inode >= t->exists) t->yval[inode] = nl;
 	sum = 0.0;
-	for (j = 0; j < nobs; j++)
-	    if (where[j] == inode)
-		sum += w[j] * log(yprob[nc * inode + (int) y[j] - 1]);
-	dev[inode] = -2 * sum;
+	for (i = b; i < e; i++) {
+	    j = t->perm[i];
+	    sum += t->w[j] * log(t->yprob[t->nc * inode + (int) t->y[j] - 1]);
+	}
+	t->dev[inode] = -2 * sum;
     }
     else {
 	n1 = 0;
 	sum = 0.0;
-	for (j = 0; j < nobs; j++)
-	    if (where[j] == inode) {
-		n1 += w[j];
-		sum += w[j] * y[j];
-	    }
-	n[inode] = n1;
-	t = sum / n1;
-	yval[inode] = t;
+	for (i = b; i < e; i++) {
+	    j = t->perm[i];
+	    n1 += t->w[j];
+	    sum += t->w[j] * t->y[j];
+	}
+	t->n[inode] = n1;
+	m = sum / n1;
+	t->yval[inode] = m;
 	sum = 0.0;
-	for (j = 0; j < nobs; j++)
-	    if (where[j] == inode) sum +=  w[j] * (y[j] - t) * (y[j] - t);
-	dev[inode] = sum;
+	for (i = b; i < e; i++) {
+	    j = t->perm[i];
+	    sum +=  t->w[j] * (t->y[j] - m) * (t->y[j] - m);
+	}
+	t->dev[inode] = sum;
     }
 }
 
@@ -171,44 +286,51 @@ static void shelldsort(double *a, double *b, double *w, int N)
 }
 
 
-static void split_cont(int inode, int iv, double *bval)
+static void split_cont(Tree *t, int inode, int iv, Scratch *sc, Split *c)
 {
-    int     i,j, js, k, ns, lo, hi;
+    int     i,j, js, k, ns, lo, hi, *ty = sc->ty;
     double  ldev, bdev, sdev, tmp, split, bsplit, cntl, totw, ysum = 0.0,
-	    ytot = 0.0, y2 = 0.0, psum;
+	    ytot = 0.0, y2 = 0.0, psum, *tvar = sc->tvar, *tyc = sc->tyc,
+	    *w1 = sc->w1, *tab = sc->tab;
 
     Printf("..trying split on var %d ", iv);
     ns = 0;
     sdev = 0.0;
     totw = 0.0;
-    for (j = 0; j < nobs; j++)
-	if (where[j] == inode) {
-	    tmp = X[j + nobs * iv]; 
+    {
+	/* with presort the node's cases are in increasing order of iv */
+	int *s = t->presort ? t->sorted[iv] : t->perm;
+	for (i = t->nbeg[inode]; i < t->nend[inode]; i++) {
+	    j = s[i];
+	    tmp = xnum(t, j, iv);
 	    if (!ISNA(tmp)) {
-		if (nc) ty[ns] = (int)(y[j] - 1);
-		else tyc[ns] = y[j];
-		w1[ns] = w[j];
+		if (t->nc) ty[ns] = (int)(t->y[j] - 1);
+		else tyc[ns] = t->y[j];
+		w1[ns] = t->w[j];
 		tvar[ns++] = tmp;
-		totw += w[j];
+		totw += t->w[j];
 	    } else {
-		if (nc) sdev -= 2*w[j]*log(yprob[nc * inode + (int) y[j] - 1]);
+		if (t->nc) sdev -= 2*t->w[j]*log(t->yprob[t->nc * inode + (int) t->y[j] - 1]);
 		else {
-		    tmp = y[j] - yval[inode];
-		    sdev += w[j]*tmp*tmp;
+		    tmp = t->y[j] - t->yval[inode];
+		    sdev += t->w[j]*tmp*tmp;
 		}
 	    }
 	}
-    if ( Gini && sdev > 0) 
-	error(_("cannot use 'Gini' with missing values"));
+    }
+    if ( t->Gini && sdev > 0) {
+	c->gini_na = True;
+	return;
+    }
     Printf(" count %d", ns);
     if ( ns < 2 || totw < EPS ) { Printf("\n"); return;}
     cntl = 0;
-    if (nc) {
-	shellsort(tvar, ty, w1, ns);
-	for (k = 0; k < 2 * nc; k++)
+    if (t->nc) {
+	if (!t->presort) shellsort(tvar, ty, w1, ns);
+	for (k = 0; k < 2 * t->nc; k++)
 	    tab[k] = 0;		/* left then right cnt */
     } else {
-	shelldsort(tvar, tyc, w1, ns);
+	if (!t->presort) shelldsort(tvar, tyc, w1, ns);
 	ysum = ytot = y2 = 0.0;
 	for (j = 0; j < ns; j++) {
 	    ytot += w1[j]*tyc[j];
@@ -219,11 +341,11 @@ static void split_cont(int inode, int iv, double *bval)
     lo = hi = -1;
     for(i = 0; i < ns; i++) {
 	psum += w1[i];
-	if(lo < 0 && psum >= mincut) lo = i;
-	if(hi < 0 && ns - psum <= mincut) hi = i;
+	if(lo < 0 && psum >= t->mincut) lo = i;
+	if(hi < 0 && ns - psum <= t->mincut) hi = i;
     }
-    lo = mincut - 1;
-    hi = ns - mincut;
+    lo = t->mincut - 1;
+    hi = ns - t->mincut;
     js = lo;
     tmp = tvar[js];
     if (tvar[ns - 1] == tmp)
@@ -231,31 +353,31 @@ static void split_cont(int inode, int iv, double *bval)
     while (tvar[js + 1] == tmp)
 	js++;
     if (js >= hi) {Printf("\n"); return;}
-    split = 0.5 * (tmp + tvar[js + 1]);
+    split = cut_between(t, iv, tmp, tvar[js + 1]);
     for (j = 0; j < ns; j++)
 	if (tvar[j] < split) {
 	    cntl += w1[j];
-	    if (!nc) ysum += w1[j]*tyc[j];
+	    if (!t->nc) ysum += w1[j]*tyc[j];
 	    else tab[ty[j]] += w1[j];
-	} else  if (nc) tab[ty[j] + nc] += w1[j];
-    if (nc) {
-	if (Gini) {
+	} else  if (t->nc) tab[ty[j] + t->nc] += w1[j];
+    if (t->nc) {
+	if (t->Gini) {
 	    ysum = 0.0;
-	    for (k = 0; k < nc; k++) {
+	    for (k = 0; k < t->nc; k++) {
 		tmp = tab[k] / cntl;
 		ysum += tmp*tmp;
 	    }
 	    ldev = totw - cntl*ysum;
 	    ysum = 0.0;
-	    for (k = 0; k < nc; k++) {
-		tmp = tab[k + nc] / (totw-cntl);
+	    for (k = 0; k < t->nc; k++) {
+		tmp = tab[k + t->nc] / (totw-cntl);
 		ysum += tmp*tmp;
 	    }
-	    ldev = (totw - cntl)*ysum;
+	    ldev -= (totw - cntl)*ysum;
 	} else {
 	    ldev = XLOGX(cntl) + XLOGX((totw - cntl));
-	    for (k = 0; k < nc; k++) {
-		ldev -= XLOGX(tab[k]) + XLOGX(tab[k + nc]);
+	    for (k = 0; k < t->nc; k++) {
+		ldev -= XLOGX(tab[k]) + XLOGX(tab[k + t->nc]);
 	    }
 	}
 	ldev *= 2;
@@ -270,39 +392,39 @@ static void split_cont(int inode, int iv, double *bval)
 	js++;
 	tmp = tvar[js];
 	if (tvar[ns - 1] == tmp) break;
-	cntl += w[js];
-	if (nc) {
+	cntl += w1[js];
+	if (t->nc) {
 	    tab[ty[js]] += w1[js];
-	    tab[ty[js] + nc] -= w1[js];
+	    tab[ty[js] + t->nc] -= w1[js];
 	} else ysum += w1[js]*tyc[js];
 	while (tvar[js + 1] == tmp) {
 	    js++;
-	    cntl += w[js];
-	    if (nc) {
+	    cntl += w1[js];
+	    if (t->nc) {
 		tab[ty[js]] += w1[js];
-		tab[ty[js] + nc] -= w1[js];
+		tab[ty[js] + t->nc] -= w1[js];
 	    } else ysum += w1[js]*tyc[js];
 	}
 	if (js >= hi) break;
-	split = 0.5 * (tmp + tvar[js + 1]);
-	if (nc) {
-	    if (Gini) {
+	split = cut_between(t, iv, tmp, tvar[js + 1]);
+	if (t->nc) {
+	    if (t->Gini) {
 		ysum = 0.0;
-		for (k = 0; k < nc; k++) {
+		for (k = 0; k < t->nc; k++) {
 		    tmp = tab[k] / cntl;
 		    ysum += tmp*tmp;
 		}
 		ldev = totw - cntl*ysum;
 		ysum = 0.0;
-		for (k = 0; k < nc; k++) {
-		    tmp = tab[k + nc] / (totw-cntl);
+		for (k = 0; k < t->nc; k++) {
+		    tmp = tab[k + t->nc] / (totw-cntl);
 		    ysum += tmp*tmp;
 		}
 		ldev -= (totw - cntl) * ysum;
 	    } else {
 		ldev = XLOGX(cntl) + XLOGX((totw - cntl));
-		for (k = 0; k < nc; k++)
-		    ldev -= XLOGX(tab[k]) + XLOGX(tab[k + nc]);
+		for (k = 0; k < t->nc; k++)
+		    ldev -= XLOGX(tab[k]) + XLOGX(tab[k + t->nc]);
 	    }
 	    ldev *= 2;
 	} else {
@@ -316,18 +438,209 @@ static void split_cont(int inode, int iv, double *bval)
     }
     bdev = bdev + sdev;
     Printf(" val %f, split %g\n", bdev, bsplit);
-    if (bdev >= *bval) return;
-    if (bdev >= devtarget) return;
-    *bval = bdev;
-    var[inode] = iv + 1;
-    snprintf(cutleft[inode], 100, "<%g", bsplit);
-    snprintf(cutright[inode], 100, ">%g", bsplit);
-    for (j = 0; j < nobs; j++)
-	if (where[j] == inode) {
-	    tmp = X[j + nobs * iv];
-	    if (ISNA(tmp)) ttw[j] = NALEVEL;
-	    else ttw[j] =  tmp > bsplit;
-	} else ttw[j] = -1;
+    if (bdev >= t->devtarget) return;
+    c->val = bdev;
+    c->cut = bsplit;
+}
+
+/* Bin the continuous columns: distinct values get their own bin if
+   there are at most nb of them, otherwise bins of roughly equal counts. */
+static int hist_init(Tree *t, int nb)
+{
+    int i, iv, j, k, b, nd, lo, hi, m;
+    double *xs, tmp, target;
+
+    t->hstride = t->nc ? t->nc + 2 : 4;
+    t->xbin = (unsigned char *) talloc(t, (size_t) t->nobs * t->nvar, sizeof(unsigned char));
+    t->hoff = (int *) talloc(t, t->nvar, sizeof(int));
+    t->nbin = (int *) talloc(t, t->nvar, sizeof(int));
+    t->bmin = (double *) talloc(t, t->nvar * HSLOT, sizeof(double));
+    t->bmax = (double *) talloc(t, t->nvar * HSLOT, sizeof(double));
+    xs = (double *) talloc(t, t->nobs, sizeof(double));
+    if (!t->xbin || !t->hoff || !t->nbin || !t->bmin || !t->bmax || !xs)
+	return TREE_NOMEM;
+    t->hsize = 0;
+    for (iv = 0; iv < t->nvar; iv++) {
+	if (t->levels[iv]) continue;
+	t->hoff[iv] = t->hsize;
+	t->hsize += HSLOT * t->hstride;
+	for (k = 0, j = 0; j < t->nobs; j++)
+	    if (!ISNA(tmp = xnum(t, j, iv)) && (!t->subset || t->subset[j]))
+		xs[k++] = tmp;
+	R_rsort(xs, k);
+	for (nd = 0, i = 0; i < k; i++)
+	    if (i == 0 || xs[i] != xs[i-1]) nd++;
+	b = 0;
+	for (i = 0; i < k; b++) {
+	    /* bin b starts at xs[i] */
+	    if (nd <= nb) target = 1;
+	    else target = (double) (k - i) / (nb - b);
+	    for (m = 0, tmp = xs[i]; i < k; ) {
+		j = i;
+		while (j < k && xs[j] == tmp) j++;
+		m += j - i;
+		i = j;
+		if ((m >= target && b < nb - 1) || i == k) break;
+		tmp = xs[i];
+	    }
+	    t->bmax[iv * HSLOT + b] = xs[i - 1];
+	}
+	t->nbin[iv] = b;
+	for (b = 0, i = 0; b < t->nbin[iv]; b++) {
+	    t->bmin[iv * HSLOT + b] = xs[i];
+	    while (i < k && xs[i] <= t->bmax[iv * HSLOT + b]) i++;
+	}
+	for (j = 0; j < t->nobs; j++) {
+	    tmp = xnum(t, j, iv);
+	    if (ISNA(tmp)) b = HNA;
+	    else {
+		lo = 0; hi = t->nbin[iv] - 1;
+		while (lo < hi) {
+		    b = (lo + hi) / 2;
+		    if (tmp <= t->bmax[iv * HSLOT + b]) hi = b; else lo = b + 1;
+		}
+		b = lo;
+	    }
+	    t->xbin[j + (size_t) t->nobs * iv] = (unsigned char) b;
+	}
+    }
+    return TREE_OK;
+}
+
+static double *hist_get(Tree *t)
+{
+    if (t->nhfree > 0) return t->hfree[--t->nhfree];
+    return (double *) talloc(t, t->hsize, sizeof(double));
+}
+
+static void hist_put(Tree *t, double *h)
+{
+    if (t->nhfree < HFREE) t->hfree[t->nhfree++] = h;
+    else tfree(t, h);
+}
+
+/* add (sign = 1) or remove (sign = -1) the rows rows[0..nr-1] */
+static void hist_add(Tree *t, double *h, int *rows, int nr, double sign)
+{
+    int i, iv, j;
+    double *p, wt;
+
+    for (iv = 0; iv < t->nvar; iv++) {
+	if (t->levels[iv]) continue;
+	for (i = 0; i < nr; i++) {
+	    j = rows[i];
+	    wt = sign * t->w[j];
+	    p = h + t->hoff[iv] + t->hstride * t->xbin[j + (size_t) t->nobs * iv];
+	    p[0] += sign;
+	    p[1] += wt;
+	    if (t->nc) p[1 + (int) t->y[j]] += wt;
+	    else {
+		p[2] += wt * t->y[j];
+		p[3] += wt * t->y[j] * t->y[j];
+	    }
+	}
+    }
+}
+
+/* histogram of the cases of inode */
+static void hist_fill(Tree *t, int inode, double *h)
+{
+    int j;
+
+    for (j = 0; j < t->hsize; j++) h[j] = 0.0;
+    hist_add(t, h, t->perm + t->nbeg[inode], t->nend[inode] - t->nbeg[inode], 1.0);
+}
+
+/* split_cont() evaluated on the bins of the node histogram h */
+static void split_hist(Tree *t, int inode, int iv, double *h, Scratch *sc, Split *c)
+{
+    int     b, b2, k, nb = t->nbin[iv], found = False;
+    double  ldev, bdev = 0.0, sdev, tmp, bsplit = 0.0, cntl, totw, ns, nsl,
+	    ysum, ytot, y2, *p = h + t->hoff[iv], *q, *tab = sc->tab;
+
+    Printf("..trying split on var %d ", iv);
+    q = p + t->hstride * HNA;
+    sdev = 0.0;
+    if (q[0] > 0) {
+	if (t->nc) {
+	    for (k = 0; k < t->nc; k++)
+		if (q[2 + k] > 0)
+		    sdev -= 2*q[2 + k]*log(t->yprob[t->nc * inode + k]);
+	} else {
+	    tmp = t->yval[inode];
+	    sdev = q[3] - 2*tmp*q[2] + tmp*tmp*q[1];
+	}
+    }
+    if ( t->Gini && sdev > 0) {
+	c->gini_na = True;
+	return;
+    }
+    ns = totw = ysum = ytot = y2 = 0.0;
+    if (t->nc) for (k = 0; k < 2 * t->nc; k++) tab[k] = 0;
+    for (b = 0; b < nb; b++) {
+	q = p + t->hstride * b;
+	ns += q[0];
+	totw += q[1];
+	if (t->nc) for (k = 0; k < t->nc; k++) tab[k + t->nc] += q[2 + k];
+	else {
+	    ytot += q[2];
+	    y2 += q[3];
+	}
+    }
+    Printf(" count %g", ns);
+    if ( ns < 2 || totw < EPS ) { Printf("\n"); return;}
+    cntl = nsl = 0.0;
+    for (b = 0; b < nb; b++) {
+	q = p + t->hstride * b;
+	if (q[0] < 0.5) continue;
+	nsl += q[0];
+	cntl += q[1];
+	if (t->nc)
+	    for (k = 0; k < t->nc; k++) {
+		tab[k] += q[2 + k];
+		tab[k + t->nc] -= q[2 + k];
+	    }
+	else ysum += q[2];
+	for (b2 = b + 1; b2 < nb; b2++) if (p[t->hstride * b2] > 0.5) break;
+	if (b2 == nb) break;
+	if (nsl < t->mincut) continue;
+	if (ns - nsl < t->mincut) break;
+	if (t->nc) {
+	    if (t->Gini) {
+		ysum = 0.0;
+		for (k = 0; k < t->nc; k++) {
+		    tmp = tab[k] / cntl;
+		    ysum += tmp*tmp;
+		}
+		ldev = totw - cntl*ysum;
+		ysum = 0.0;
+		for (k = 0; k < t->nc; k++) {
+		    tmp = tab[k + t->nc] / (totw-cntl);
+		    ysum += tmp*tmp;
+		}
+		ldev -= (totw - cntl) * ysum;
+	    } else {
+		ldev = XLOGX(cntl) + XLOGX((totw - cntl));
+		for (k = 0; k < t->nc; k++)
+		    ldev -= XLOGX(tab[k]) + XLOGX(tab[k + t->nc]);
+	    }
+	    ldev *= 2;
+	} else {
+	    ldev = y2 - ysum*ysum/cntl - (ytot-ysum)*(ytot-ysum)/(totw-cntl);
+	}
+	if (!found || ldev < bdev) {
+	    found = True;
+	    bdev = ldev;
+	    bsplit = cut_between(t, iv, t->bmax[iv * HSLOT + b],
+				 t->bmin[iv * HSLOT + b2]);
+	}
+    }
+    if (!found) { Printf("\n"); return;}
+    bdev = bdev + sdev;
+    Printf(" val %f, split %g\n", bdev, bsplit);
+    if (bdev >= t->devtarget) return;
+    c->val = bdev;
+    c->cut = bsplit;
 }
 
 static char lb[32] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 
@@ -335,120 +648,111 @@ static char lb[32] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
 		      'u', 'v', 'w', 'x', 'y', 'z', 
 		      '0', '1', '2', '3', '4', '5'};
 
-static void split_disc(int inode, int iv, double *bval)
+static void split_disc(Tree *t, int inode, int iv, Scratch *sc, Split *c)
 {
-    int     i, ii, iis, j, k, l, mi, nl = levels[iv], nll;
+    int     i, ii, iis, j, jj, k, l, mi, nl = t->levels[iv], nll, *ind = sc->ind,
+	*indl = sc->indl;
     double  bdev, ldev, sdev, val, fence, bfence, cntl, 
-	cntr, cntl1, cntr1, tmp, ysum, ytot, y2;
-    char    *labl, *labr;
+	cntr, cntl1, cntr1, tmp, ysum, ytot, y2, *cnt = sc->cnt,
+	*tab = sc->tab, *ys = sc->ys, *cprob = sc->cprob,
+	*scprob = sc->scprob, *w1 = sc->w1;
 
     Printf("..trying split on var %d ", iv);
 
-    for (l = 0; l < nl; l++) ind[l] = False;
+    ytot = y2 = 0.0;
+    for (l = 0; l < nl; l++) {
+	ind[l] = False;
+	cnt[l] = 0;
+	if (t->nc) for (k = 0; k < t->nc; k++) tab[k + t->nc * l] = 0;
+	else ys[l] = 0;
+    }
     sdev = 0.0;
-    for (j = 0; j < nobs; j++)
-	if (where[j] == inode) {
-	    if (ISNA(X[j + nobs * iv])) {
-		twhere[j] = NALEVEL;
-		if (nc) sdev -= 2*w[j]*log(yprob[nc * inode + (int) y[j] - 1]);
-		else {
-		    tmp = y[j] - yval[inode];
-		    sdev += w[j]*tmp*tmp;
-		}
-	    } else {
-		twhere[j] = (int) X[j + nobs * iv] - 1;
-		if (w[j] > 0) ind[twhere[j]] = True;
+    for (jj = t->nbeg[inode]; jj < t->nend[inode]; jj++) {
+	j = t->perm[jj];
+	if ((l = xlevel(t, j, iv)) < 0) {
+	    if (t->nc) sdev -= 2*t->w[j]*log(t->yprob[t->nc * inode + (int) t->y[j] - 1]);
+	    else {
+		tmp = t->y[j] - t->yval[inode];
+		sdev += t->w[j]*tmp*tmp;
 	    }
-	} else twhere[j] = -1;
-    if ( Gini && sdev > 0) 
-	error(_("cannot use 'Gini' with missing values"));
-    ytot = y2 = 0.0;
+	} else {
+	    if (t->w[j] > 0) ind[l] = True;
+	    cnt[l] += t->w[j];
+	    if (t->nc) tab[(int) t->y[j] - 1 + t->nc * l] += t->w[j];
+	    else {
+		ys[l] += t->w[j] * t->y[j];
+		y2 += t->w[j] * t->y[j] * t->y[j];
+		ytot += t->w[j] * t->y[j];
+	    }
+	}
+    }
+    if ( t->Gini && sdev > 0) {
+	c->gini_na = True;
+	return;
+    }
     nll = 0;
     for (l = 0; l < nl; l++) {
 	nll += ind[l];
 	if (ind[l]) ind[nll - 1] = l;
-	cnt[l] = 0;
-	if (nc) for (k = 0; k < nc; k++) tab[k + nc * l] = 0;
-	else ys[l] = 0;
     }
     if (nll < 2) {
 	Printf(" no split\n");
 	return;
     }
 
-    for (j = 0; j < nobs; j++) {
-	l = twhere[j];
-	if (l >= 0) {
-	    cnt[l] += w[j];
-	    if (nc) tab[(int) y[j] - 1 + nc * l] += w[j];
-	    else {
-		ys[l] += w[j] * y[j];
-		y2 += w[j] * y[j] * y[j];
-		ytot += w[j] * y[j];
-	    }
-	}
-    }
     /* remove empty levels */
     for (l = 0; l < nll; l++) {
 	cnt[l] = cnt[ind[l]];
-	if (nc) for (k = 0; k < nc; k++) 
-	    tab[k + nc * l] = tab[k + nc * ind[l]];
+	if (t->nc) for (k = 0; k < t->nc; k++) 
+	    tab[k + t->nc * l] = tab[k + t->nc * ind[l]];
 	else ys[l] = ys[ind[l]];
     }
     if (nll == 2) {  /* Only 2 levels */
 	Printf(" counts %g %g", cnt[0], cnt[1]);
 	for (l = 0; l < nll; l++)
-	    if (cnt[l] < mincut) {
+	    if (cnt[l] < t->mincut) {
 		Printf("\n");
 		return;
 	    }
 	ldev = 0.0;
 	for (l = 0; l < nll; l++) {
-	    if (nc) {
-		if (Gini) {
+	    if (t->nc) {
+		if (t->Gini) {
 		    ysum = 0.0;
-		    for (k = 0; k < nc; k++) {
-			tmp = tab[k + nc * l] / cnt[l];
+		    for (k = 0; k < t->nc; k++) {
+			tmp = tab[k + t->nc * l] / cnt[l];
 			ysum += tmp*tmp;
 		    }
 		    ldev += cnt[l]*(1 - ysum);
 		} else {
-		    for (k = 0; k < nc; k++) ldev -= XLOGX(tab[k + nc * l]);
+		    for (k = 0; k < t->nc; k++) ldev -= XLOGX(tab[k + t->nc * l]);
 		    ldev += XLOGX(cnt[l]);
 		}
 	    } else {
 		ldev += ys[l]*ys[l]/cnt[l];
 	    }
 	}
-	if (!nc) ldev = y2 - ldev;
+	if (!t->nc) ldev = y2 - ldev;
 	else ldev *= 2;
 	val = ldev + sdev;
 	Printf(" val %f\n", val);
-	if (val >= devtarget || val >= *bval) return;
-	*bval = val;
-	var[inode] = iv + 1;
-	labl = cutleft[inode];
-	labr = cutright[inode];
-	strcpy(labl, ":");
-	strcpy(labr, ":");
-	// need a shorthand: a-z0-5 as max 32 levels.
-	scat(labl, lb[ind[0]]);
-	scat(labr, lb[ind[1]]);
-	for (j = 0; j < nobs; j++)
-	    if (twhere[j] < 0) ttw[j] = twhere[j];
-	    else ttw[j] = (twhere[j] != ind[0]);
+	if (val >= t->devtarget) return;
+	c->val = val;
+	for (l = 0; l < nl; l++) c->left[l] = -1;
+	c->left[ind[0]] = 1;
+	c->left[ind[1]] = 0;
 
     } else {
 
 	/* Treat 2 levels  and regression separately, also ordered */
 
-	if (nc <= 2 || ordered[iv]) {
-	    if(ordered[iv]) {
+	if (t->nc <= 2 || t->ordered[iv]) {
+	    if(t->ordered[iv]) {
 		for (l = 0; l < nll; l++) scprob[l] = cprob[l] = l;
 	    } else {
-		if (nc) {
+		if (t->nc) {
 		    for (l = 0; l < nll; l++) {
-			cprob[l] = (double) tab[1+nc*l] / cnt[l];
+			cprob[l] = (double) tab[1+t->nc*l] / cnt[l];
 			scprob[l] = cprob[l];
 		    }
 		    shellsort(scprob, indl, w1, nll);
@@ -460,7 +764,7 @@ static void split_disc(int inode, int iv, double *bval)
 		    shellsort(scprob, indl, w1, nll);
 		}
 	    }
-	    bdev = devtarget;
+	    bdev = t->devtarget;
 	    bfence = -1;
 
 	    Printf(" cnts "); for(l = 0; l < nll; l++) Printf(" %g", cnt[l]);
@@ -472,24 +776,24 @@ static void split_disc(int inode, int iv, double *bval)
 		for (l = 0; l < nll; l++)
 		    if (cprob[l] < fence) cntl += cnt[l];
 		    else cntr += cnt[l];
-		if (cntl < mincut || cntr < mincut) continue;
-		if (nc) {
-		    if (Gini) {
-			ldev = n[inode];
-			for (k = 0; k < nc; k++) {
+		if (cntl < t->mincut || cntr < t->mincut) continue;
+		if (t->nc) {
+		    if (t->Gini) {
+			ldev = t->n[inode];
+			for (k = 0; k < t->nc; k++) {
 			    cntl1 = cntr1 = 0;
 			    for (l = 0; l < nll; l++)
-				if (cprob[l] < fence) cntl1 += tab[k + nc * l];
-				else cntr1 += tab[k + nc * l];
+				if (cprob[l] < fence) cntl1 += tab[k + t->nc * l];
+				else cntr1 += tab[k + t->nc * l];
 			    ldev -= cntl1*cntl1/cntl + cntr1*cntr1/cntr;
 			}
 		    } else {
 			ldev = XLOGX(cntl) + XLOGX(cntr);
-			for (k = 0; k < nc; k++) {
+			for (k = 0; k < t->nc; k++) {
 			    cntl1 = cntr1 = 0;
 			    for (l = 0; l < nll; l++)
-				if (cprob[l] < fence) cntl1 += tab[k + nc * l];
-				else cntr1 += tab[k + nc * l];
+				if (cprob[l] < fence) cntl1 += tab[k + t->nc * l];
+				else cntr1 += tab[k + t->nc * l];
 			    ldev -= XLOGX(cntl1) + XLOGX(cntr1);
 			}
 		    }
@@ -508,24 +812,95 @@ static void split_disc(int inode, int iv, double *bval)
 	    }
 	    val = bdev + sdev;
 	    Printf(" val %f fence %f\n", val, bfence);
-	    if (val >= devtarget || val >= *bval) return;
-	    *bval = val;
-	    var[inode] = iv + 1;
-	    labl = cutleft[inode];
-	    labr = cutright[inode];
-	    strcpy(labl, ":");
-	    strcpy(labr, ":");
-	    for (l = 0; l < nll; l++)
-		if (cprob[l] < bfence) scat(labl, lb[ind[l]]);
-		else scat(labr, lb[ind[l]]);
-/* Printf("%s %s\n", labl, labr); */
-	    for (l = 0; l < nl; l++) indl[l] = False;
+	    if (val >= t->devtarget) return;
+	    c->val = val;
+	    for (l = 0; l < nl; l++) c->left[l] = -1;
+	    for (l = 0; l < nll; l++) c->left[ind[l]] = cprob[l] < bfence;
+
+	} else if (t->fsplit) {
+
+	    /* order the levels by their scores on the first principal
+	       component of the class proportions, and split that order */
+	    int nc = t->nc, bi = -1;
+	    double *cv = sc->pc, *v = cv + nc * nc, *v2 = v + nc, *tl = v2 + nc,
+		nt = 0.0, s2;
+
+	    for (k = 0; k < nc; k++) tl[k] = 0.0;
+	    for (l = 0; l < nll; l++) {
+		nt += cnt[l];
+		for (k = 0; k < nc; k++) tl[k] += tab[k + nc * l];
+	    }
+	    for (k = 0; k < nc * nc; k++) cv[k] = 0.0;
 	    for (l = 0; l < nll; l++)
-		if (cprob[l] < bfence) indl[ind[l]] = True;
-/*	 for(l = 0; l < nl; l++) Printf(" %d", indl[l]); Printf("\n");*/
-	    for (j = 0; j < nobs; j++)
-		if (twhere[j] < 0) ttw[j] = twhere[j];
-		else ttw[j] = !indl[twhere[j]];
+		for (j = 0; j < nc; j++) {
+		    tmp = tab[j + nc * l] / cnt[l] - tl[j] / nt;
+		    for (k = 0; k <= j; k++)
+			cv[k + nc * j] += cnt[l] * tmp *
+			    (tab[k + nc * l] / cnt[l] - tl[k] / nt);
+		}
+	    for (j = 0; j < nc; j++)
+		for (k = 0; k < j; k++) cv[j + nc * k] = cv[k + nc * j];
+	    for (mi = 0, k = 1; k < nc; k++)
+		if (cv[k + nc * k] > cv[mi + nc * mi]) mi = k;
+	    for (k = 0; k < nc; k++) v[k] = (k == mi);
+	    /* power iteration */
+	    for (ii = 0; ii < 100; ii++) {
+		for (s2 = 0.0, j = 0; j < nc; j++) {
+		    for (v2[j] = 0.0, k = 0; k < nc; k++)
+			v2[j] += cv[j + nc * k] * v[k];
+		    s2 += v2[j] * v2[j];
+		}
+		if (s2 <= 0) break;
+		s2 = sqrt(s2);
+		for (tmp = 0.0, k = 0; k < nc; k++) {
+		    v2[k] /= s2;
+		    tmp += fabs(v2[k] - v[k]);
+		    v[k] = v2[k];
+		}
+		if (tmp < 1e-10) break;
+	    }
+	    for (l = 0; l < nll; l++) {
+		for (tmp = 0.0, k = 0; k < nc; k++)
+		    tmp += v[k] * tab[k + nc * l] / cnt[l];
+		scprob[l] = cprob[l] = tmp;
+		indl[l] = l;
+	    }
+	    shellsort(scprob, indl, w1, nll);
+
+	    bdev = t->devtarget;
+	    cntl = 0.0;
+	    for (k = 0; k < nc; k++) v2[k] = 0.0;
+	    for (i = 1; i < nll; i++) {
+		l = indl[i - 1];
+		cntl += cnt[l];
+		for (k = 0; k < nc; k++) v2[k] += tab[k + nc * l];
+		cntr = nt - cntl;
+		if (cntl < t->mincut || cntr < t->mincut) continue;
+		if (t->Gini) {
+		    ldev = t->n[inode];
+		    for (k = 0; k < nc; k++)
+			ldev -= v2[k]*v2[k]/cntl + 
+			    (tl[k] - v2[k])*(tl[k] - v2[k])/cntr;
+		} else {
+		    ldev = XLOGX(cntl) + XLOGX(cntr);
+		    for (k = 0; k < nc; k++)
+			ldev -= XLOGX(v2[k]) + XLOGX(tl[k] - v2[k]);
+		}
+		ldev *= 2;
+		if (ldev < bdev) {
+		    bdev = ldev;
+		    bi = i;
+		}
+	    }
+	    val = bdev + sdev;
+	    Printf(" val %f at %d of the pc order\n", val, bi);
+	    if (val >= t->devtarget) return;
+	    c->val = val;
+	    for (l = 0; l < nl; l++) c->left[l] = -1;
+	    for (i = 0; i < nll; i++) c->left[ind[indl[i]]] = i < bi;
+	    /* the first level goes left, as in the exhaustive search */
+	    if (!c->left[ind[0]])
+		for (l = 0; l < nll; l++) c->left[ind[l]] = !c->left[ind[l]];
 
 	} else {
 
@@ -533,7 +908,7 @@ static void split_disc(int inode, int iv, double *bval)
 	    Printf("\n"); 
 	    indl[0] = True;
 	    for (l = 1; l < nll; l++) indl[l] = False;
-	    bdev = devtarget;
+	    bdev = t->devtarget;
 	    mi = 1;
 	    iis = -1;
 	    for(l = 1; l < nll; l++) mi *= 2;
@@ -549,23 +924,23 @@ static void split_disc(int inode, int iv, double *bval)
 			cntl += cnt[l];
 		    else
 			cntr += cnt[l];
-		if (cntl < mincut || cntr < mincut) continue;
-		if (Gini) {
-		    ldev = n[inode];
-		    for (k = 0; k < nc; k++) {
+		if (cntl < t->mincut || cntr < t->mincut) continue;
+		if (t->Gini) {
+		    ldev = t->n[inode];
+		    for (k = 0; k < t->nc; k++) {
 			cntl1 = cntr1 = 0;
 			for (l = 0; l < nll; l++)
-			    if (indl[l]) cntl1 += tab[k + nc * l];
-			    else cntr1 += tab[k + nc * l];
+			    if (indl[l]) cntl1 += tab[k + t->nc * l];
+			    else cntr1 += tab[k + t->nc * l];
 			ldev -= cntl1*cntl1/cntl + cntr1*cntr1/cntr;
 		    }
 		} else {
 		    ldev = XLOGX(cntl) + XLOGX(cntr);
-		    for (k = 0; k < nc; k++) {
+		    for (k = 0; k < t->nc; k++) {
 			cntl1 = cntr1 = 0;
 			for (l = 0; l < nll; l++)
-			    if (indl[l]) cntl1 += tab[k + nc * l];
-			    else cntr1 += tab[k + nc * l];
+			    if (indl[l]) cntl1 += tab[k + t->nc * l];
+			    else cntr1 += tab[k + t->nc * l];
 			ldev -= XLOGX(cntl1) + XLOGX(cntr1);
 		    }
 		}
@@ -579,204 +954,1291 @@ static void split_disc(int inode, int iv, double *bval)
 	    }
 	    val = bdev + sdev;
 	    Printf(" val %f at bin val %d\n", val, iis);
-	    if (val >= *bval || val >= devtarget) return;
-	    *bval = val;
+	    if (val >= t->devtarget) return;
+	    c->val = val;
+	    indl[0] = True;
 	    for(l = 1; l < nll; l++) {
 		indl[l] = (iis%2);
 		iis /= 2;
 	    }
-	    var[inode] = iv + 1;
-	    labl = cutleft[inode];
-	    labr = cutright[inode];
-	    strcpy(labl, ":");
-	    strcpy(labr, ":");
-	    for (l = 0; l < nll; l++)
-		if (indl[l]) scat(labl, lb[ind[l]]);
-		else scat(labr, lb[ind[l]]);
-	    for (l = 0; l < nl; l++) indr[l] = False;
-	    for (l = 0; l < nll; l++) indr[ind[l]] = indl[l];
-	    for (j = 0; j < nobs; j++)
-		if (twhere[j] < 0) ttw[j] = twhere[j];
-		else ttw[j] = !indr[twhere[j]];
+	    for (l = 0; l < nl; l++) c->left[l] = -1;
+	    for (l = 0; l < nll; l++) c->left[ind[l]] = indl[l];
 	}
     }
 }
 
-static void shift_up_node(int i, int N)
+/* Record the chosen split of inode on iv */
+static void record_split(Tree *t, int inode, int iv, Split *c)
 {
-    int j, k;
-/*    Printf("shifting %d to %d\n", i, i+N); */
-    var[i+N] = var[i];
-    cutleft[i+N] = cutleft[i];
-    cutright[i+N] = cutright[i];
-/*    Printf("(%d) %d to %d %s %s %p\n", node[i], i, i+N, cutleft[i+N], 
-      cutright[i+N], *(cutleft+i+N));*/
-    n[i+N] = n[i];
-    dev[i+N] = dev[i];
-    yval[i+N] = yval[i];
-    node[i+N] = node[i];
-    for (k = 0; k < nc; k++) yprob[(i+N)*nc+k] = yprob[i*nc+k];
-    for (j = 0; j < nobs; j++) if (where[j] == i) where[j] +=N;
+    int l;
+    unsigned int *lm, *rm;
+
+    t->var[inode] = iv + 1;
+    lm = t->lmask + (size_t) inode * t->nw;
+    rm = t->rmask + (size_t) inode * t->nw;
+    for (l = 0; l < t->nw; l++) lm[l] = rm[l] = 0;
+    if (t->levels[iv]) {
+	for (l = 0; l < t->levels[iv]; l++)
+	    if (c->left[l] == 1) lm[l / 32] |= 1U << (l % 32);
+	    else if (c->left[l] == 0) rm[l / 32] |= 1U << (l % 32);
+    } else t->cut[inode] = c->cut;
 }
 
-static void shift_down_node(int i, int N)
+/* The side each case of inode goes to by its recorded split, in ttw[]
+   (0 left, 1 right, NALEVEL missing) */
+static void split_rows(Tree *t, int inode)
 {
-    int j, k;
-/*    Printf("shifting %d to %d %p\n", i+N, i); */
-    var[i] = var[i+N];
-    cutleft[i] = cutleft[i+N];
-    cutright[i] = cutright[i+N];
-    n[i] = n[i+N];
-    dev[i] = dev[i+N];
-    yval[i] = yval[i+N];
-    node[i] = node[i+N];
-/*    Printf("(%d) %d to %d %s %s %p\n", node[i], i+N, i, cutleft[i], 
-      cutright[i], *(cutleft+i)); */
-    for (k = 0; k < nc; k++) yprob[i*nc+k] = yprob[(i+N)*nc+k];
-    for (j = 0; j < nobs; j++) if (where[j] == i+N) where[j] -=N; 
+    int i, j, l, iv = t->var[inode] - 1;
+    unsigned int *lm = t->lmask + (size_t) inode * t->nw;
+    double tmp;
+
+    for (i = t->nbeg[inode]; i < t->nend[inode]; i++) {
+	j = t->perm[i];
+	if (t->levels[iv]) {
+	    l = xlevel(t, j, iv);
+	    t->ttw[j] = (l < 0) ? NALEVEL : !(lm[l / 32] >> (l % 32) & 1);
+	} else {
+	    tmp = xnum(t, j, iv);
+	    t->ttw[j] = ISNA(tmp) ? NALEVEL : tmp > t->cut[inode];
+	}
+    }
 }
 
-static void divide_node(int inode)
+/* Set up the node ranges for the current where[] (root or the leaves of
+   an existing tree), and for presort distribute the sorted columns. */
+static void ranges_init(Tree *t)
 {
-    int     i, iv, j, k, shift, shifted = False;
-    double  bval, tmp;
+    int i, iv, j, k, m, *cur;
+
+    for (i = 0; i < t->nnode; i++) t->nend[i] = 0;
+    for (j = 0; j < t->nobs; j++) if (t->where[j] >= 0) t->nend[t->where[j]]++;
+    for (m = 0, i = 0; i < t->nnode; i++) {
+	t->nbeg[i] = m;
+	m += t->nend[i];
+	t->nend[i] = m;
+    }
+    cur = t->rcur;
+    for (i = 0; i < t->nnode; i++) cur[i] = t->nbeg[i];
+    for (j = 0; j < t->nobs; j++)
+	if (t->where[j] >= 0) t->perm[cur[t->where[j]]++] = j;
+    if (!t->presort) return;
+    for (iv = 0; iv < t->nvar; iv++) {
+	if (t->levels[iv]) continue;
+	/* distribute to the nodes, keeping the order */
+	for (i = 0; i < t->nnode; i++) cur[i] = t->nbeg[i];
+	for (k = 0; k < t->nobs; k++) {
+	    j = t->xord[iv][k];
+	    if (t->where[j] >= 0) t->sorted[iv][cur[t->where[j]]++] = j;
+	}
+    }
+}
 
-    if (inode >= nmax) error(_("tree is too big"));
+/* presort: the order of each continuous column, NAs last, found once */
+static int presort_init(Tree *t)
+{
+    int iv, j, k;
+    double tmp, *xs = (double *) talloc(t, t->nobs, sizeof(double));
 
-    fillin_node(inode);
-    if ( n[inode] < minsize ) return;
+    t->xord = (int **) talloc(t, t->nvar, sizeof(int *));
+    if (!xs || !t->xord) return TREE_NOMEM;
+    for (iv = 0; iv < t->nvar; iv++) {
+	if (t->levels[iv]) continue;
+	t->xord[iv] = (int *) talloc(t, t->nobs, sizeof(int));
+	if (!t->xord[iv]) return TREE_NOMEM;
+	for (k = 0, j = 0; j < t->nobs; j++)
+	    if (!ISNA(tmp = xnum(t, j, iv))) {
+		xs[k] = tmp;
+		t->xord[iv][k++] = j;
+	    }
+	if (k > 0) R_qsort_I(xs, t->xord[iv], 1, k);
+	for (j = 0; j < t->nobs; j++)
+	    if (ISNA(xnum(t, j, iv))) t->xord[iv][k++] = j;
+    }
+    return TREE_OK;
+}
 
-    if (Gini) {
+/* Stable partition of s[b] .. s[e-1] into left (ttw == 0), right
+   (ttw == 1) and dropped (missing split variable) cases */
+static void partition(Tree *t, int *s, int b, int e, int *pnl, int *pnr)
+{
+    int i, j, l = b, r = 0, d = 0;
+
+    for (i = b; i < e; i++) {
+	j = s[i];
+	if (t->ttw[j] == 0) s[l++] = j;
+	else if (t->ttw[j] == 1) t->tpart[r++] = j;
+	else t->tpart[t->nobs - ++d] = j;
+    }
+    *pnl = l - b;
+    *pnr = r;
+    for (i = 0; i < r; i++) s[l++] = t->tpart[i];
+    for (i = 1; i <= d; i++) s[l++] = t->tpart[t->nobs - i];
+}
+
+/* uniform on [0, 1) from a xorshift generator, for the variables
+   searched at a node: each tree has its own, so the choices do not
+   depend on how trees are shared among threads */
+static double tree_unif(Tree *t)
+{
+    t->seed ^= t->seed << 13;
+    t->seed ^= t->seed >> 17;
+    t->seed ^= t->seed << 5;
+    return (t->seed >> 8) * (1.0 / 16777216.0);
+}
+
+/* The best split of inode (after fillin_node) as t->cand[*pbest], or
+   *pbest = -1 if it is not to be split, and the reduction it gives in
+   the deviance (or Gini index) in *pgain.  For the histogram engine *ph
+   is the node's histogram, made here if NULL. */
+static int best_split(Tree *t, int inode, double **ph, int *pbest,
+		      double *pgain)
+{
+    int     i, iv, k, best = -1, bad = False;
+    double  bval, tmp, *h = *ph;
+
+    *pbest = -1;
+    if ( t->n[inode] < t->minsize ||
+	 (t->maxdepth > 0 && t->node[inode] >= (1 << t->maxdepth)) )
+	return TREE_OK;
+
+    if (t->Gini) {
 	bval = 0.0;
-	for (k = 0; k < nc; k++) {
-	    tmp = yprob[inode*nc + k];
+	for (k = 0; k < t->nc; k++) {
+	    tmp = t->yprob[inode*t->nc + k];
 	    bval += tmp *tmp;
 	}
-	bval = n[inode] * (1 - bval);
+	bval = t->n[inode] * (1 - bval);
 	bval *= 2.0;
 	Printf("gini = %g\n", bval);
-	devtarget = bval;
+	t->devtarget = bval;
     } else {
-	bval = dev[inode];
-	devtarget = dev[inode] - mindev*dev[0];
+	bval = t->dev[inode];
+	t->devtarget = t->dev[inode] - t->mindev*t->dev[0];
     }
-    if(devtarget <= (1e-6)*dev[0]) return;
+    if(t->devtarget <= (1e-6)*t->dev[0]) return TREE_OK;
+    *pgain = bval;
     Printf("\n--evaluating node %d(%d) size %g\n", inode, 
-	   (int)node[inode], n[inode]);
+	   (int)t->node[inode], t->n[inode]);
 
-    for (iv = 0; iv < nvar; iv++)
-	if (levels[iv])
-	    split_disc(inode, iv, &bval);
+    if (t->hist && !h) {
+	if (!(h = *ph = hist_get(t))) return TREE_NOMEM;
+	hist_fill(t, inode, h);
+    }
+    for (iv = 0; iv < t->nvar; iv++) {
+	t->cand[iv].val = DBL_MAX;
+	t->cand[iv].gini_na = False;
+    }
+    if (t->vuse) {
+	/* a random mtry of the variables, by a partial shuffle of the
+	   indices held after the flags */
+	int *vp = t->vuse + t->nvar;
+	for (iv = 0; iv < t->nvar; iv++) {
+	    t->vuse[iv] = False;
+	    vp[iv] = iv;
+	}
+	for (k = 0; k < t->mtry; k++) {
+	    i = k + (int) (tree_unif(t) * (t->nvar - k));
+	    iv = vp[i];
+	    vp[i] = vp[k];
+	    vp[k] = iv;
+	    t->vuse[iv] = True;
+	}
+    }
+    /* the variables are searched independently, possibly in parallel,
+       and the first best one taken */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(t->nthreads) schedule(dynamic, 1) \
+    if(t->nthreads > 1 && (double) (t->nend[inode] - t->nbeg[inode]) * t->nvar >= PARMIN)
+#endif
+    for (iv = 0; iv < t->nvar; iv++) {
+	Scratch *sc = t->scr;
+#ifdef _OPENMP
+	sc += omp_get_thread_num();
+#endif
+	if (t->vuse && !t->vuse[iv]) continue;
+	if (t->levels[iv])
+	    split_disc(t, inode, iv, sc, t->cand + iv);
+	else if (t->hist)
+	    split_hist(t, inode, iv, h, sc, t->cand + iv);
 	else
-	    split_cont(inode, iv, &bval);
+	    split_cont(t, inode, iv, sc, t->cand + iv);
+    }
+    for (iv = 0; iv < t->nvar; iv++) {
+	if (t->cand[iv].gini_na) bad = True;
+	if (t->cand[iv].val < bval) {
+	    bval = t->cand[iv].val;
+	    best = iv;
+	}
+    }
+    if (bad) return TREE_GININA;
 
     Printf("..best value is %g\n", bval);
-   
-    if (bval < devtarget) {
-        Printf("..splitting\n");
-	if ( node[inode] >=  1073741824 ) {
-	    error(_("maximum depth reached\n"));
-	    return;
-	}
-   
-	if (inode < nnode-1) {
-	    shifted = nnode;
-	    for (i= nnode-1; i > inode; i--) shift_up_node(i, nmax-nnode);
-	    nnode = inode + 1;
-/*Printf("..shifted up\n");*/
-	} else shifted = False;
-	/* write left as nnode */
-	for (j = 0; j < nobs; j++) {
-	    if (ttw[j] == 0) where[j] = nnode;
-	    if (ttw[j] == NALEVEL) where[j] += NALEVEL;
-	}
-	node[nnode++] = 2 * node[inode];
-	divide_node(nnode-1);
-	Printf("..done left at %d\n", inode);
-	/* write right as nnode */
-	for (j = 0; j < nobs; j++)
-	    if (where[j] == inode) where[j] = nnode;
-	node[nnode++] = 2 * node[inode] + 1;
-	divide_node(nnode-1);
-	Printf("..done right at %d\n", inode);
-	if (shifted) {
-	    shift = nnode - inode -1;
-	    for (i = inode+1; i < shifted; i++) 
-		shift_down_node(i+shift, nmax-shifted-shift);
-	    offset += shift;
-	    nnode = shifted + shift;
-/*Printf("..shifted down\n");*/
+    *pbest = best;
+    *pgain -= bval;
+    return TREE_OK;
+}
+
+/* The nodes are grown in a pool of ncap, doubled (up to nmax) as
+   needed: a node is appended when made and never moved, node i having
+   children kid[i] and kid[i] + 1 (kid[i] = -1 if not split here) */
+static int pool_reserve(Tree *t, int need)
+{
+    int cap = max(t->ncap, 1), nc1 = max(t->nc, 1);
+
+    if (need <= t->ncap) return TREE_OK;
+    if (need > t->nmax) return TREE_BIG;
+    while (cap < need) cap *= 2;
+    if (cap > t->nmax) cap = t->nmax;
+#define GROW(p, type, k) \
+    if (!(p = (type *) trealloc(t, p, (size_t) cap * (k), sizeof(type)))) \
+	return TREE_NOMEM
+    GROW(t->nbeg, int, 1); GROW(t->nend, int, 1); GROW(t->orig, int, 1);
+    GROW(t->rcur, int, 1); GROW(t->kid, int, 1); GROW(t->bvar, int, 1);
+    GROW(t->heap, int, 1); GROW(t->hgain, double, 1);
+    GROW(t->hnode, double *, 1);
+    GROW(t->cut, double, 1);
+    GROW(t->lmask, unsigned int, t->nw); GROW(t->rmask, unsigned int, t->nw);
+    GROW(t->pnode, Sint, 1); GROW(t->pvar, Sint, 1); GROW(t->pn, double, 1);
+    GROW(t->pdev, double, 1); GROW(t->pyval, double, 1);
+    GROW(t->pyprob, double, nc1);
+#undef GROW
+    t->ncap = cap;
+    return TREE_OK;
+}
+
+static void pool_use(Tree *t)
+{
+    t->node = t->pnode; t->var = t->pvar; t->n = t->pn;
+    t->dev = t->pdev; t->yval = t->pyval; t->yprob = t->pyprob;
+}
+
+/* Append the children of node i, split by its recorded split, and
+   partition its cases among them, the dropped (missing) ones last */
+static int make_kids(Tree *t, int i)
+{
+    int j, k, iv, nl, nr, b, e, rbeg, rend, res;
+
+    if (t->node[i] >= 1073741824) return TREE_DEPTH;
+    if ((res = pool_reserve(t, t->nnode + 2)) != TREE_OK) return res;
+    pool_use(t);
+    split_rows(t, i);
+    b = t->nbeg[i];
+    e = t->nend[i];
+    partition(t, t->perm, b, e, &nl, &nr);
+    if (t->presort)
+	for (iv = 0; iv < t->nvar; iv++)
+	    if (!t->levels[iv]) partition(t, t->sorted[iv], b, e, &nl, &nr);
+    rbeg = b + nl;
+    rend = rbeg + nr;
+    k = t->kid[i] = t->nnode;
+    for (j = b; j < rbeg; j++) t->where[t->perm[j]] = k;
+    for (j = rbeg; j < rend; j++) t->where[t->perm[j]] = k + 1;
+    for (j = rend; j < e; j++) t->where[t->perm[j]] += NALEVEL;
+    t->nbeg[k] = b;
+    t->nend[k] = rbeg;
+    t->node[k] = 2 * t->node[i];
+    t->nbeg[k + 1] = rbeg;
+    t->nend[k + 1] = rend;
+    t->node[k + 1] = 2 * t->node[i] + 1;
+    t->nnode += 2;
+    return TREE_OK;
+}
+
+/* The histograms of the children of inode from its histogram h, which
+   is given back: the smaller child is histogrammed, and the other got by
+   subtraction from the parent less the dropped (NA) rows */
+static int hist_kids(Tree *t, int inode, double *h, double **phl,
+		     double **phr)
+{
+    int     i, k = t->kid[inode], b = t->nbeg[k], rbeg = t->nend[k],
+	    rend = t->nend[k + 1], nl = rbeg - b, nr = rend - rbeg;
+    double  *hl, *hr;
+
+    hl = hist_get(t);
+    hr = hist_get(t);
+    if (!hl || !hr) return TREE_NOMEM;
+    for (i = 0; i < t->hsize; i++) hl[i] = 0.0;
+    if (nl > nr) hist_add(t, hl, t->perm + rbeg, nr, 1.0);
+    else hist_add(t, hl, t->perm + b, nl, 1.0);
+    for (i = 0; i < t->hsize; i++) hr[i] = h[i] - hl[i];
+    hist_add(t, hr, t->perm + rend, t->nend[inode] - rend, -1.0);
+    if (nl > nr) {
+	double *ht = hl;
+	hl = hr;
+	hr = ht;
+    }
+    hist_put(t, h);
+    *phl = hl;
+    *phr = hr;
+    return TREE_OK;
+}
+
+/* Divide inode depth-first, whose histogram h (if any) is handed over
+   to us */
+static int divide_node(Tree *t, int inode, int parent, double *h)
+{
+    int     k, best, res;
+    double  gain, *hl = NULL, *hr = NULL;
+
+    fillin_node(t, inode, parent);
+    t->kid[inode] = -1;
+    if ((res = best_split(t, inode, &h, &best, &gain)) != TREE_OK)
+	return res;
+    if (best < 0) {
+	if (h) hist_put(t, h);
+	return TREE_OK;
+    }
+    Printf("..splitting\n");
+    record_split(t, inode, best, t->cand + best);
+    if ((res = make_kids(t, inode)) != TREE_OK) return res;
+    k = t->kid[inode];
+    if (t->hist && (res = hist_kids(t, inode, h, &hl, &hr)) != TREE_OK)
+	return res;
+    if ((res = divide_node(t, k, inode, hl)) != TREE_OK) return res;
+    return divide_node(t, k + 1, inode, hr);
+}
+
+/* a max-heap of the nodes waiting to be split, by the gain of their
+   best split and then the order they were made */
+static int heap_before(Tree *t, int a, int b)
+{
+    return t->hgain[a] > t->hgain[b] || (t->hgain[a] == t->hgain[b] && a < b);
+}
+
+static void heap_push(Tree *t, int i)
+{
+    int k = t->nheap++, p;
+
+    while (k > 0 && heap_before(t, i, t->heap[p = (k - 1) / 2])) {
+	t->heap[k] = t->heap[p];
+	k = p;
+    }
+    t->heap[k] = i;
+}
+
+static int heap_pop(Tree *t)
+{
+    int top = t->heap[0], last = t->heap[--t->nheap], k = 0, c;
+
+    while ((c = 2 * k + 1) < t->nheap) {
+	if (c + 1 < t->nheap && heap_before(t, t->heap[c + 1], t->heap[c])) c++;
+	if (!heap_before(t, t->heap[c], last)) break;
+	t->heap[k] = t->heap[c];
+	k = c;
+    }
+    t->heap[k] = last;
+    return top;
+}
+
+/* Fill in node i and queue it with its best split, if any, and its
+   histogram h (if any, which is handed over to us) for its children */
+static int queue_node(Tree *t, int i, int parent, double *h)
+{
+    int best, res;
+    double gain;
+
+    fillin_node(t, i, parent);
+    t->kid[i] = -1;
+    res = best_split(t, i, &h, &best, &gain);
+    if (res != TREE_OK || best < 0) {
+	if (h) hist_put(t, h);
+	return res;
+    }
+    record_split(t, i, best, t->cand + best);
+    t->bvar[i] = t->var[i];
+    t->var[i] = 0;
+    t->hgain[i] = gain;
+    t->hnode[i] = h;
+    heap_push(t, i);
+    return TREE_OK;
+}
+
+/* Best-first growth from the leaves: the leaf whose split most reduces
+   the deviance is split next, until there are maxleaves leaves or no
+   more splits */
+static int grow_best(Tree *t, int nleaf)
+{
+    int i, k, res = TREE_OK;
+    double *hl = NULL, *hr = NULL;
+
+    t->nheap = 0;
+    for (i = 0; i < max(t->exists, 1); i++)
+	if (!t->var[i] && (res = queue_node(t, i, -1, NULL)) != TREE_OK)
+	    return res;
+    while (t->nheap > 0 && nleaf < t->maxleaves) {
+	i = heap_pop(t);
+	t->var[i] = t->bvar[i];
+	if ((res = make_kids(t, i)) != TREE_OK) return res;
+	nleaf++;
+	k = t->kid[i];
+	if (t->hist &&
+	    (res = hist_kids(t, i, t->hnode[i], &hl, &hr)) != TREE_OK)
+	    return res;
+	if ((res = queue_node(t, k, i, hl)) != TREE_OK ||
+	    (res = queue_node(t, k + 1, i, hr)) != TREE_OK) return res;
+    }
+    /* the histograms of the leaves left unsplit */
+    while (t->nheap > 0) {
+	i = heap_pop(t);
+	if (t->hnode[i]) hist_put(t, t->hnode[i]);
+    }
+    return TREE_OK;
+}
+
+/* Put the pool in preorder into the caller's node arrays, and the
+   splits, orig and where[] to match.  The nodes of an existing tree
+   (or the root) are already in preorder, and the new ones hang below
+   them. */
+static int pool_preorder(Tree *t, Sint *onode, Sint *ovar, double *on,
+			 double *odev, double *oyval, double *oyprob)
+{
+    int i, j, k = 0, r, sp, nw = t->nw, nc = t->nc, *pre = t->heap,
+	*stack = t->rcur;
+    unsigned int *m;
+
+    for (r = 0; r < max(t->exists, 1); r++) {
+	stack[0] = r;
+	for (sp = 1; sp > 0; k++) {
+	    i = stack[--sp];
+	    pre[i] = k;
+	    if (t->kid[i] >= 0) {
+		stack[sp++] = t->kid[i] + 1;
+		stack[sp++] = t->kid[i];
+	    }
 	}
     }
+    m = (unsigned int *) malloc(2 * (size_t) t->nnode * nw * sizeof(unsigned int));
+    if (!m) return TREE_NOMEM;
+    for (i = 0; i < t->nnode; i++) {
+	k = pre[i];
+	onode[k] = t->node[i];
+	ovar[k] = t->var[i];
+	on[k] = t->n[i];
+	odev[k] = t->dev[i];
+	oyval[k] = t->yval[i];
+	for (j = 0; j < nc; j++) oyprob[k * nc + j] = t->yprob[i * nc + j];
+	t->hgain[k] = t->var[i] ? t->cut[i] : 0.0;
+	t->rcur[k] = t->orig[i];
+	for (j = 0; j < nw; j++) {
+	    m[k * nw + j] = t->var[i] ? t->lmask[i * nw + j] : 0;
+	    m[(t->nnode + k) * nw + j] = t->var[i] ? t->rmask[i * nw + j] : 0;
+	}
+    }
+    for (i = 0; i < t->nnode; i++) {
+	t->cut[i] = t->hgain[i];
+	t->orig[i] = t->rcur[i];
+	for (j = 0; j < nw; j++) {
+	    t->lmask[i * nw + j] = m[i * nw + j];
+	    t->rmask[i * nw + j] = m[(t->nnode + i) * nw + j];
+	}
+    }
+    free(m);
+    for (j = 0; j < t->nobs; j++) {
+	if (t->subset && !t->subset[j]) continue;
+	k = t->where[j];
+	t->where[j] = (k >= 0) ? pre[k] : pre[k - NALEVEL] + NALEVEL;
+    }
+    return TREE_OK;
 }
 
-void 
-BDRgrow1(double *pX, double *pY, double *pw, Sint *plevels, Sint *junk1, 
-	 Sint *pnobs, Sint *pncol, Sint *pnode, Sint *pvar, char **pcutleft, 
-	 char **pcutright, double *pn, double *pdev, double *pyval, 
-	 double *pyprob, Sint *pminsize, Sint *pmincut, double *pmindev, 
-	 Sint *pnnode, Sint *pwhere, Sint *pnmax, Sint *stype, Sint *pordered)
+/* The set-up of the data, which is only read in growing: the binned
+   or sorted columns.  Trees grown from copies of t (with their own
+   tree_work()) share it. */
+static int tree_prepare(Tree *t)
 {
-    int i, nl;
+    int i, nl, res;
 
-    X = pX; y = pY; w = pw; dev = pdev; yval = pyval; yprob = pyprob;
-    nobs = *pnobs; nvar = *pncol;
-    levels = plevels; node = pnode; var = pvar; n = pn; mindev = *pmindev;
-    minsize = *pminsize; mincut = *pmincut; nmax = *pnmax; nnode = *pnnode;
-    where = pwhere; cutleft = pcutleft; cutright = pcutright; 
-    ordered= pordered; Gini = *stype;
-    nc = levels[nvar];
-    Printf("nnode: %d\n", nnode);
-    Printf("nvar: %d\n", nvar);
-    for(i = 0; i <= nvar; i++) Printf("%d ", (int)levels[i]);
+    t->nc = t->levels[t->nvar];
+    t->presort = t->hist = False;
+    if (t->engine > 0)
+	for(i = 0; i < t->nvar; i++) if (!t->levels[i]) t->presort = True;
+    if (t->presort && t->engine == 2) {
+	t->presort = False;
+	t->hist = True;
+    }
+    Printf("nnode: %d\n", t->nnode);
+    Printf("nvar: %d\n", t->nvar);
+    for(i = 0; i <= t->nvar; i++) Printf("%d ", (int)t->levels[i]);
     Printf("\n");
-    /* allocate scratch storage */
     nl = 0;
-    for(i = 0; i <= nvar; i++)
-	if (levels[i] > nl) nl = levels[i];
-    maxnl = max(nl, 10);
-    if (maxnl > 32) error("factor predictors must have at most 32 levels");
-    twhere = (int *) S_alloc(nobs, sizeof(int));
-    ttw = (int *) S_alloc(nobs, sizeof(int));
-    tvar = (double *) S_alloc(nobs, sizeof(double));
-    ind = (int *) S_alloc(nl, sizeof(int));
-    w1 = (double *) S_alloc(nobs, sizeof(double));
-    cnt = (double *) S_alloc(nl, sizeof(double));
-    cprob = (double*) S_alloc(nl, sizeof(double));
-    scprob = (double*) S_alloc(nl, sizeof(double));
-    indl = (int*) S_alloc(nl, sizeof(int));
-    if (nc > 0) {
-	yp = (double *) S_alloc(nc, sizeof(double));
-	tab = (double*) S_alloc(nl*(1+nc), sizeof(double));
-	indr = (int*) S_alloc(nl, sizeof(int));
-	ty = (int *) S_alloc(nobs, sizeof(int));
-    } else {
-	tyc = (double *) S_alloc(nobs, sizeof(double));
-	ys = (double *) S_alloc(nl, sizeof(double));
-    }
-    exists = nnode;
-    offset = 0;
-    if (exists <= 1) {
-	for(i = 0; i < nobs; i++) where[i] = 0;
-	nnode = 1;
-	node[0] = 1;
-	divide_node(0);
-    } else {
+    for(i = 0; i <= t->nvar; i++)
+	if (t->levels[i] > nl) nl = t->levels[i];
+    t->maxnl = max(nl, 10);
+    /* all the splits of an unordered factor are tried for more than
+       two classes, unless ordered by principal component */
+    for(i = 0; i < t->nvar; i++)
+	if (t->levels[i] > 32 && t->nc > 2 && !t->ordered[i] && !t->fsplit)
+	    return TREE_LEVELS;
+    for(i = 0, t->nw = 1; i < t->nvar; i++)
+	t->nw = max(t->nw, (t->levels[i] + 31) / 32);
+#ifdef _OPENMP
+    t->nthreads = max(t->nthreads, 1);
+#else
+    t->nthreads = 1;
+#endif
+    if (t->X) {
+	t->xcol = (double **) talloc(t, t->nvar, sizeof(double *));
+	if (!t->xcol) return TREE_NOMEM;
+	for(i = 0; i < t->nvar; i++) t->xcol[i] = t->X + (size_t) t->nobs * i;
+	t->xcode = NULL;
+	t->xflt = NULL;
+    }
+    if (t->presort && (res = presort_init(t)) != TREE_OK) return res;
+    if (t->hist && (res = hist_init(t, t->nbins)) != TREE_OK) return res;
+    return TREE_OK;
+}
+
+/* The working storage of growing one tree */
+static int tree_work(Tree *t)
+{
+    int i, nl;
+
+    nl = 0;
+    for(i = 0; i <= t->nvar; i++)
+	if (t->levels[i] > nl) nl = t->levels[i];
+    /* allocate scratch storage */
+    t->ttw = (int *) talloc(t, t->nobs, sizeof(int));
+    t->scr = (Scratch *) talloc(t, t->nthreads, sizeof(Scratch));
+    t->cand = (Split *) talloc(t, t->nvar, sizeof(Split));
+    t->perm = (int *) talloc(t, t->nobs, sizeof(int));
+    t->tpart = (int *) talloc(t, t->nobs, sizeof(int));
+    /* the node pool, which grows as needed */
+    t->ncap = min(t->nmax, 64);
+    t->nbeg = (int *) talloc(t, t->ncap, sizeof(int));
+    t->nend = (int *) talloc(t, t->ncap, sizeof(int));
+    t->orig = (int *) talloc(t, t->ncap, sizeof(int));
+    t->cut = (double *) talloc(t, t->ncap, sizeof(double));
+    t->lmask = (unsigned int *) talloc(t, (size_t) t->ncap * t->nw,
+				       sizeof(unsigned int));
+    t->rmask = (unsigned int *) talloc(t, (size_t) t->ncap * t->nw,
+				       sizeof(unsigned int));
+    t->sorted = (int **) talloc(t, t->nvar, sizeof(int *));
+    t->rcur = (int *) talloc(t, t->ncap, sizeof(int));
+    t->kid = (int *) talloc(t, t->ncap, sizeof(int));
+    t->bvar = (int *) talloc(t, t->ncap, sizeof(int));
+    t->heap = (int *) talloc(t, t->ncap, sizeof(int));
+    t->hgain = (double *) talloc(t, t->ncap, sizeof(double));
+    t->hnode = (double **) talloc(t, t->ncap, sizeof(double *));
+    t->pnode = (Sint *) talloc(t, t->ncap, sizeof(Sint));
+    t->pvar = (Sint *) talloc(t, t->ncap, sizeof(Sint));
+    t->pn = (double *) talloc(t, t->ncap, sizeof(double));
+    t->pdev = (double *) talloc(t, t->ncap, sizeof(double));
+    t->pyval = (double *) talloc(t, t->ncap, sizeof(double));
+    t->pyprob = (double *) talloc(t, (size_t) t->ncap * max(t->nc, 1),
+				  sizeof(double));
+    if (!t->kid || !t->bvar || !t->heap || !t->hgain || !t->hnode ||
+	!t->pnode || !t->pvar || !t->pn || !t->pdev || !t->pyval ||
+	!t->pyprob) return TREE_NOMEM;
+    if (!t->ttw || !t->scr || !t->cand || !t->perm || !t->tpart ||
+	!t->nbeg || !t->nend || !t->orig || !t->cut || !t->lmask ||
+	!t->rmask || !t->sorted || !t->rcur) return TREE_NOMEM;
+    if (t->presort)
+	for (i = 0; i < t->nvar; i++)
+	    if (!t->levels[i] &&
+		!(t->sorted[i] = (int *) talloc(t, t->nobs, sizeof(int))))
+		return TREE_NOMEM;
+    if (t->hist) {
+	t->hfree = (double **) talloc(t, HFREE, sizeof(double *));
+	t->nhfree = 0;
+	if (!t->hfree) return TREE_NOMEM;
+    }
+    for (i = 0; i < t->nthreads; i++) {
+	Scratch *sc = t->scr + i;
+	sc->tvar = (double *) talloc(t, t->nobs, sizeof(double));
+	sc->ind = (int *) talloc(t, nl, sizeof(int));
+	sc->w1 = (double *) talloc(t, max(t->nobs, nl), sizeof(double));
+	sc->cnt = (double *) talloc(t, nl, sizeof(double));
+	sc->cprob = (double*) talloc(t, nl, sizeof(double));
+	sc->scprob = (double*) talloc(t, nl, sizeof(double));
+	sc->indl = (int*) talloc(t, nl, sizeof(int));
+	if (t->nc > 2 && t->fsplit &&
+	    !(sc->pc = (double *) talloc(t, t->nc * (t->nc + 3), sizeof(double))))
+	    return TREE_NOMEM;
+	if (t->nc > 0) {
+	    sc->tab = (double*) talloc(t, nl*(1+t->nc), sizeof(double));
+	    sc->ty = (int *) talloc(t, t->nobs, sizeof(int));
+	    if (!sc->tab || !sc->ty) return TREE_NOMEM;
+	} else {
+	    sc->tyc = (double *) talloc(t, t->nobs, sizeof(double));
+	    sc->ys = (double *) talloc(t, nl, sizeof(double));
+	    if (!sc->tyc || !sc->ys) return TREE_NOMEM;
+	}
+	if (!sc->tvar || !sc->ind || !sc->w1 || !sc->cnt || !sc->cprob ||
+	    !sc->scprob || !sc->indl) return TREE_NOMEM;
+    }
+    for (i = 0; i < t->nvar; i++)
+	if (!(t->cand[i].left = (int *) talloc(t, t->levels[i], sizeof(int))))
+	    return TREE_NOMEM;
+    t->vuse = NULL;
+    if (t->mtry > 0 && t->mtry < t->nvar) {
+	t->vuse = (int *) talloc(t, 2 * t->nvar, sizeof(int));
+	if (!t->vuse) return TREE_NOMEM;
+	if (!t->seed) t->seed = 2463534242U;
+    }
+    t->ready = True;
+    return TREE_OK;
+}
+
+int tree_setup(Tree *t)
+{
+    int res;
+
+    t->mem = NULL;
+    t->nmem = t->amem = 0;
+    if ((res = tree_prepare(t)) != TREE_OK) return res;
+    return tree_work(t);
+}
+
+/* Grow t from its root, or from the leaves of the t->nnode nodes it
+   has on input, except those with var -1 which are kept as leaves.
+   where[] is 1-based on input (if nnode > 1) and output.  A new tree
+   may be grown with node NULL, and then node, var, n, dev, yval and
+   yprob are set to arrays of just nnode in the working storage, as they
+   are also if readonly is set.
+   Returns TREE_OK or an error code; call tree_free() in either case.
+   The working storage (and the binned or sorted columns) is set up by
+   tree_setup() on the first call and kept until tree_free(), so more
+   trees can be grown from the same X and w, e.g. for new y. */
+int tree_grow(Tree *t)
+{
+    Sint *onode = t->node, *ovar = t->var;
+    double *on = t->n, *odev = t->dev, *oyval = t->yval,
+	*oyprob = t->yprob;
+    int i, k, nleaf, res;
+
+    if (!t->ready && (res = tree_setup(t)) != TREE_OK) return res;
+    /* the nodes of an existing tree are copied to the pool and kept in
+       place, and only its leaves are divided */
+    t->exists = (t->nnode > 1) ? t->nnode : 0;
+    if ((res = pool_reserve(t, max(t->exists, 1))) != TREE_OK) return res;
+    pool_use(t);
+    for (i = 0; i < t->exists; i++) {
+	t->node[i] = onode[i];
+	t->var[i] = ovar[i];
+	t->n[i] = on[i];
+	t->dev[i] = odev[i];
+	t->yval[i] = oyval[i];
+	for (k = 0; k < t->nc; k++)
+	    t->yprob[i * t->nc + k] = oyprob[i * t->nc + k];
+	t->orig[i] = i;
+	t->kid[i] = -1;
+	t->cut[i] = 0.0;
+	for (k = 0; k < t->nw; k++)
+	    t->lmask[i * t->nw + k] = t->rmask[i * t->nw + k] = 0;
+    }
+    if (t->exists) {
 	/* Adjust from S indexing */
-	for(i = 0; i < nobs; i++) where[i]--;
-	for(i = 0; i < exists; i++)
-	    if (!var[i+offset]) {
-/* Printf("trying node %d at offset %d, nnode %d\n", i, offset, nnode);*/
-		divide_node(i + offset);
-	    }
+	for(i = 0; i < t->nobs; i++)
+	    t->where[i] = (t->subset && !t->subset[i]) ? -1 : t->where[i] - 1;
+	for (i = 0, nleaf = 0; i < t->exists; i++) if (t->var[i] <= 0) nleaf++;
+    } else {
+	for(i = 0; i < t->nobs; i++)
+	    t->where[i] = (t->subset && !t->subset[i]) ? -1 : 0;
+	t->nnode = 1;
+	t->node[0] = 1;
+	t->var[0] = 0;
+	nleaf = 1;
+    }
+    ranges_init(t);
+    if (t->maxleaves > 0) res = grow_best(t, nleaf);
+    else
+	for (i = 0; i < max(t->exists, 1) && res == TREE_OK; i++)
+	    if (!t->var[i]) res = divide_node(t, i, -1, NULL);
+    for (i = 0; i < t->exists; i++) if (t->var[i] < 0) t->var[i] = 0;
+    if (res == TREE_OK && (!onode || t->readonly)) {
+	/* the caller left the node arrays to us: just nnode long */
+	onode = (Sint *) talloc(t, 2 * (size_t) t->nnode, sizeof(Sint));
+	on = (double *) talloc(t, (size_t) t->nnode * (3 + t->nc),
+			       sizeof(double));
+	if (!onode || !on) res = TREE_NOMEM;
+	else {
+	    ovar = onode + t->nnode;
+	    odev = on + t->nnode;
+	    oyval = odev + t->nnode;
+	    oyprob = oyval + t->nnode;
+	}
     }
+    if (res == TREE_OK)
+	res = pool_preorder(t, onode, ovar, on, odev, oyval, oyprob);
+    /* the pool may have moved */
+    t->pnode = t->node; t->pvar = t->var; t->pn = t->n;
+    t->pdev = t->dev; t->pyval = t->yval; t->pyprob = t->yprob;
+    t->node = onode; t->var = ovar; t->n = on;
+    t->dev = odev; t->yval = oyval; t->yprob = oyprob;
+    if (res != TREE_OK) return res;
     /* Adjust to S indexing */
 
-    for(i = 0; i < nobs; i++) {
-	if(where[i] < 0) where[i] -= NALEVEL;
-	where[i]++;
+    for(i = 0; i < t->nobs; i++) {
+	if (t->subset && !t->subset[i]) {
+	    t->where[i] = 0;
+	    continue;
+	}
+	if(t->where[i] < 0) t->where[i] -= NALEVEL;
+	t->where[i]++;
     }
-    *pnnode = nnode;
     Printf("Finished!\n");
+    return TREE_OK;
+}
+
+const char *tree_errmsg(int res)
+{
+    switch(res) {
+    case TREE_NOMEM: return _("out of memory growing tree");
+    case TREE_BIG: return _("tree is too big");
+    case TREE_DEPTH: return _("maximum depth reached\n");
+    case TREE_GININA: return _("cannot use 'Gini' with missing values");
+    case TREE_LEVELS: return _("unordered factor predictors must have at most 32 levels for more than two classes");
+    case TREE_SINGLE: return _("can not prune singlenode tree");
+    }
+    return "";
 }
 
+/* The split labels used by the R code: "<cut" and ">cut", or the levels
+   going each way as a shorthand a-z0-5 for at most 32 levels, otherwise
+   as ":#" and a hex digit for each 4 levels, lowest bit first */
+#define LABLEN(nl) ((nl) > 96 ? (nl) / 4 + 4 : 100)
+
+static void split_labels(Tree *t, int i, char *labl, char *labr)
+{
+    int iv = t->var[i] - 1, l, nl;
+    unsigned int *lm = t->lmask + (size_t) i * t->nw,
+	*rm = t->rmask + (size_t) i * t->nw;
+
+    *labl = *labr = '\0';
+    if (iv < 0) return;
+    if ((nl = t->levels[iv]) > 32) {
+	static const char hex[] = "0123456789abcdef";
+	strcpy(labl, ":#");
+	strcpy(labr, ":#");
+	for (l = 0; l < nl; l += 4) {
+	    labl[2 + l / 4] = hex[lm[l / 32] >> (l % 32) & 15];
+	    labr[2 + l / 4] = hex[rm[l / 32] >> (l % 32) & 15];
+	}
+	labl[2 + (nl + 3) / 4] = labr[2 + (nl + 3) / 4] = '\0';
+    } else if (nl) {
+	strcpy(labl, ":");
+	strcpy(labr, ":");
+	for (l = 0; l < nl; l++)
+	    if (lm[0] >> l & 1) scat(labl, lb[l]);
+	    else if (rm[0] >> l & 1) scat(labr, lb[l]);
+    } else if (t->xflt && t->xflt[iv]) {
+	snprintf(labl, 100, "<%.9g", t->cut[i]);
+	snprintf(labr, 100, ">%.9g", t->cut[i]);
+    } else {
+	snprintf(labl, 100, "<%g", t->cut[i]);
+	snprintf(labr, 100, ">%g", t->cut[i]);
+    }
+}
+
+/* Point t at the predictors sX for the .Call entry points: a double
+   matrix, or a list of columns, double or (for factors) integer codes,
+   so that a data frame need not be made into a matrix.  A raw column of
+   4 * nobs bytes holds single-precision values, as from tree.single() */
+static void tree_data(Tree *t, SEXP sX)
+{
+    int iv;
+    SEXP col;
+
+    t->X = NULL;
+    t->xcol = (double **) R_alloc(t->nvar, sizeof(double *));
+    t->xcode = (int **) R_alloc(t->nvar, sizeof(int *));
+    t->xflt = NULL;
+    if (TYPEOF(sX) == REALSXP && XLENGTH(sX) == (R_xlen_t) t->nobs * t->nvar) {
+	for (iv = 0; iv < t->nvar; iv++) {
+	    t->xcol[iv] = REAL(sX) + (size_t) t->nobs * iv;
+	    t->xcode[iv] = NULL;
+	}
+	return;
+    }
+    if (TYPEOF(sX) != VECSXP || LENGTH(sX) != t->nvar)
+	error(_("invalid predictors for tree growing"));
+    for (iv = 0; iv < t->nvar; iv++) {
+	col = VECTOR_ELT(sX, iv);
+	t->xcol[iv] = NULL;
+	t->xcode[iv] = NULL;
+	if (TYPEOF(col) == RAWSXP && !t->levels[iv] &&
+	    XLENGTH(col) == 4 * (R_xlen_t) t->nobs) {
+	    if (!t->xflt) {
+		t->xflt = (float **) R_alloc(t->nvar, sizeof(float *));
+		memset(t->xflt, 0, t->nvar * sizeof(float *));
+	    }
+	    t->xflt[iv] = (float *) RAW(col);
+	    continue;
+	}
+	if (LENGTH(col) != t->nobs)
+	    error(_("invalid predictors for tree growing"));
+	if (TYPEOF(col) == REALSXP) t->xcol[iv] = REAL(col);
+	else if (TYPEOF(col) == INTSXP && t->levels[iv])
+	    t->xcode[iv] = INTEGER(col);
+	else error(_("invalid predictors for tree growing"));
+    }
+}
+
+/* The settings of the .Call growers from ctrl, (minsize, mincut, nmax,
+   Gini, engine, nbins, nthreads, fsplit, maxleaves, maxdepth, mtry): the
+   first four then those of tree.ctrl() */
+static void tree_ctrl(Tree *t, SEXP sctrl)
+{
+    int *ctrl;
+
+    if (TYPEOF(sctrl) != INTSXP || LENGTH(sctrl) != 11)
+	error(_("invalid control for tree growing"));
+    ctrl = INTEGER(sctrl);
+    t->minsize = ctrl[0]; t->mincut = ctrl[1]; t->nmax = ctrl[2];
+    t->Gini = ctrl[3]; t->engine = ctrl[4]; t->nbins = ctrl[5];
+    t->nthreads = ctrl[6]; t->fsplit = ctrl[7]; t->maxleaves = ctrl[8];
+    t->maxdepth = ctrl[9]; t->mtry = ctrl[10];
+}
+
+void 
+BDRgrow1(double *pX, double *pY, double *pw, Sint *plevels, Sint *junk1, 
+	 Sint *pnobs, Sint *pncol, Sint *pnode, Sint *pvar, char **pcutleft, 
+	 char **pcutright, double *pn, double *pdev, double *pyval, 
+	 double *pyprob, Sint *pminsize, Sint *pmincut, double *pmindev, 
+	 Sint *pnnode, Sint *pwhere, Sint *pnmax, Sint *stype, Sint *pordered,
+	 Sint *pctrl)
+{
+    Tree tr, *t = &tr;
+    int i, res;
+    char **oleft, **oright;
+
+    memset(t, 0, sizeof(Tree));
+    t->X = pX; t->y = pY; t->w = pw;
+    t->nobs = *pnobs; t->nvar = *pncol;
+    t->levels = plevels; t->ordered = pordered;
+    t->minsize = *pminsize; t->mincut = *pmincut; t->mindev = *pmindev;
+    t->nmax = *pnmax; t->Gini = *stype;
+    t->engine = pctrl[0]; t->nbins = pctrl[1]; t->nthreads = pctrl[2];
+    t->fsplit = pctrl[3]; t->maxleaves = pctrl[4]; t->maxdepth = pctrl[5];
+    t->nnode = *pnnode;
+    t->node = pnode; t->var = pvar; t->where = pwhere;
+    t->n = pn; t->dev = pdev; t->yval = pyval; t->yprob = pyprob;
+    /* labels of the nodes of an existing tree, which may move */
+    oleft = (char **) R_alloc(t->nnode, sizeof(char *));
+    oright = (char **) R_alloc(t->nnode, sizeof(char *));
+    for (i = 0; i < t->nnode; i++) {
+	oleft[i] = pcutleft[i];
+	oright[i] = pcutright[i];
+    }
+    res = tree_grow(t);
+    if (res != TREE_OK) {
+	tree_free(t);
+	error("%s", tree_errmsg(res));
+    }
+    for (i = 0; i < t->nnode; i++)
+	if (t->orig[i] >= 0) {
+	    pcutleft[i] = oleft[t->orig[i]];
+	    pcutright[i] = oright[t->orig[i]];
+	} else {
+	    int len = t->var[i] ? LABLEN(t->levels[t->var[i] - 1]) : 1;
+	    pcutleft[i] = (char *) S_alloc(len, sizeof(char));
+	    pcutright[i] = (char *) S_alloc(len, sizeof(char));
+	    split_labels(t, i, pcutleft[i], pcutright[i]);
+	}
+    *pnnode = t->nnode;
+    tree_free(t);
+}
+
+/* .Call version of BDRgrow1, using X (see tree_data), y and w in place
+   and returning only the nodes grown, with ctrl as for tree_ctrl().  old is
+   NULL for a new tree, or to regrow an existing tree a list of its node,
+   var (-1 at the leaves to be kept), cutleft, cutright, n, dev, yval,
+   yprob and where as BDRgrow1 takes them, the labels of its splits being
+   kept.  The value is a list of node, var, cutleft, cutright, n, dev,
+   yval, yprob (classes x nodes, as for BDRgrow1) and where. */
+SEXP
+BDRgrow2(SEXP sX, SEXP sy, SEXP sw, SEXP slevels, SEXP sordered, SEXP sctrl,
+	 SEXP smindev, SEXP sold)
+{
+    Tree tr, *t = &tr;
+    int i, nr, nc, res;
+    const char *nms[] = {"node", "var", "cutleft", "cutright", "n", "dev",
+			 "yval", "yprob", "where"};
+    char *labl, *labr;
+    SEXP ans, names, sl, sr, swhere, oleft = R_NilValue, oright = R_NilValue;
+
+    if (TYPEOF(sy) != REALSXP || TYPEOF(sw) != REALSXP)
+	error(_("invalid data for tree growing"));
+    memset(t, 0, sizeof(Tree));
+    t->y = REAL(sy); t->w = REAL(sw);
+    t->nobs = LENGTH(sy); t->nvar = LENGTH(slevels) - 1;
+    t->levels = INTEGER(slevels); t->ordered = INTEGER(sordered);
+    tree_data(t, sX);
+    tree_ctrl(t, sctrl);
+    t->mindev = asReal(smindev);
+    PROTECT(swhere = allocVector(INTSXP, t->nobs));
+    t->where = INTEGER(swhere);
+    if (!isNull(sold)) {
+	int nn, *w;
+	if (TYPEOF(sold) != VECSXP || LENGTH(sold) != 9)
+	    error(_("invalid tree to regrow"));
+	/* the tree comes from an editable frame: check it all */
+	nn = LENGTH(VECTOR_ELT(sold, 0));
+	if (nn < 1) error(_("invalid tree to regrow"));
+	for (i = 0; i < 8; i++) {
+	    SEXP el = VECTOR_ELT(sold, i);
+	    int type = (i < 2) ? INTSXP : (i < 4) ? STRSXP : REALSXP;
+	    R_xlen_t len = (i == 7) ? (R_xlen_t) nn * t->levels[t->nvar] : nn;
+	    if (TYPEOF(el) != type || XLENGTH(el) != len)
+		error(_("invalid tree to regrow"));
+	}
+	for (i = 0; i < nn; i++) {
+	    int v = INTEGER(VECTOR_ELT(sold, 1))[i];
+	    if (v < -1 || v > t->nvar) error(_("invalid tree to regrow"));
+	}
+	if (TYPEOF(VECTOR_ELT(sold, 8)) != INTSXP ||
+	    LENGTH(VECTOR_ELT(sold, 8)) != t->nobs)
+	    error(_("invalid tree to regrow"));
+	w = INTEGER(VECTOR_ELT(sold, 8));
+	for (i = 0; i < t->nobs; i++)
+	    if (w[i] < 1 || w[i] > nn) error(_("invalid tree to regrow"));
+	t->nnode = nn;
+	t->node = INTEGER(VECTOR_ELT(sold, 0));
+	t->var = INTEGER(VECTOR_ELT(sold, 1));
+	oleft = VECTOR_ELT(sold, 2);
+	oright = VECTOR_ELT(sold, 3);
+	t->n = REAL(VECTOR_ELT(sold, 4));
+	t->dev = REAL(VECTOR_ELT(sold, 5));
+	t->yval = REAL(VECTOR_ELT(sold, 6));
+	t->yprob = REAL(VECTOR_ELT(sold, 7));
+	memcpy(t->where, w, t->nobs * sizeof(int));
+	t->readonly = True;
+    }
+    res = tree_grow(t);
+    if (res != TREE_OK) {
+	tree_free(t);
+	error("%s", tree_errmsg(res));
+    }
+    nr = t->nnode;
+    nc = t->nc;
+    PROTECT(ans = allocVector(VECSXP, 9));
+    PROTECT(names = allocVector(STRSXP, 9));
+    for (i = 0; i < 9; i++) SET_STRING_ELT(names, i, mkChar(nms[i]));
+    setAttrib(ans, R_NamesSymbol, names);
+    SET_VECTOR_ELT(ans, 0, allocVector(INTSXP, nr));
+    SET_VECTOR_ELT(ans, 1, allocVector(INTSXP, nr));
+    SET_VECTOR_ELT(ans, 2, sl = allocVector(STRSXP, nr));
+    SET_VECTOR_ELT(ans, 3, sr = allocVector(STRSXP, nr));
+    SET_VECTOR_ELT(ans, 4, allocVector(REALSXP, nr));
+    SET_VECTOR_ELT(ans, 5, allocVector(REALSXP, nr));
+    SET_VECTOR_ELT(ans, 6, allocVector(REALSXP, nr));
+    SET_VECTOR_ELT(ans, 7, allocVector(REALSXP, (R_xlen_t) nr * nc));
+    SET_VECTOR_ELT(ans, 8, swhere);
+    memcpy(INTEGER(VECTOR_ELT(ans, 0)), t->node, nr * sizeof(int));
+    memcpy(INTEGER(VECTOR_ELT(ans, 1)), t->var, nr * sizeof(int));
+    memcpy(REAL(VECTOR_ELT(ans, 4)), t->n, nr * sizeof(double));
+    memcpy(REAL(VECTOR_ELT(ans, 5)), t->dev, nr * sizeof(double));
+    memcpy(REAL(VECTOR_ELT(ans, 6)), t->yval, nr * sizeof(double));
+    if (nc)
+	memcpy(REAL(VECTOR_ELT(ans, 7)), t->yprob,
+	       (size_t) nr * nc * sizeof(double));
+    labl = R_alloc(LABLEN(t->maxnl), sizeof(char));
+    labr = R_alloc(LABLEN(t->maxnl), sizeof(char));
+    for (i = 0; i < nr; i++) {
+	if (t->readonly && t->orig[i] >= 0) {
+	    SET_STRING_ELT(sl, i, STRING_ELT(oleft, t->orig[i]));
+	    SET_STRING_ELT(sr, i, STRING_ELT(oright, t->orig[i]));
+	    continue;
+	}
+	split_labels(t, i, labl, labr);
+	SET_STRING_ELT(sl, i, mkChar(labl));
+	SET_STRING_ELT(sr, i, mkChar(labr));
+    }
+    tree_free(t);
+    UNPROTECT(3);
+    return ans;
+}
+
+/* An ensemble of trees grown from the same X and y: tree b uses case
+   weights w * counts[, b], leaving out the cases with count 0, and
+   searches mtry random variables at each node if 0 < mtry < nvar.  ctrl
+   is as for tree_ctrl(), and its nthreads threads share the trees, each
+   grown on one.  seeds[b] seeds the choices of variables.  X is sorted
+   or binned once, on all the cases, and only the working storage is
+   made for each tree.  The value is a list with a list for each tree of
+   its node, var, cut, lmask, rmask, n, dev, yval and yprob (a nodes x
+   classes matrix, or NULL for regression). */
+
+typedef struct {
+    int nnode, nw, res;
+    Sint *node, *var, *lmask, *rmask;
+    double *cut, *n, *dev, *yval, *yprob;
+} BagTree;
+
+/* keep only the nnode entries of t, and the splits before tree_free */
+static int bag_keep(Tree *t, BagTree *bt)
+{
+    int i, j, nr = t->nnode, nc = t->levels[t->nvar], nw = t->nw;
+
+    bt->nnode = nr;
+    bt->nw = nw;
+    bt->node = (Sint *) malloc((2 + 2 * nw) * (size_t) nr * sizeof(Sint));
+    bt->cut = (double *) malloc((4 + nc) * (size_t) nr * sizeof(double));
+    if (!bt->node || !bt->cut) return TREE_NOMEM;
+    bt->var = bt->node + nr;
+    bt->lmask = bt->var + nr;
+    bt->rmask = bt->lmask + (size_t) nw * nr;
+    bt->n = bt->cut + nr;
+    bt->dev = bt->n + nr;
+    bt->yval = bt->dev + nr;
+    bt->yprob = bt->yval + nr;
+    for (i = 0; i < nr; i++) {
+	bt->node[i] = t->node[i];
+	bt->var[i] = t->var[i];
+	for (j = 0; j < nw; j++) {
+	    bt->lmask[i * nw + j] = (Sint) t->lmask[i * nw + j];
+	    bt->rmask[i * nw + j] = (Sint) t->rmask[i * nw + j];
+	}
+	bt->cut[i] = (t->var[i] && !t->levels[t->var[i] - 1]) ?
+	    t->cut[i] : NA_REAL;
+	bt->n[i] = t->n[i];
+	bt->dev[i] = t->dev[i];
+	bt->yval[i] = t->yval[i];
+	for (j = 0; j < nc; j++)
+	    bt->yprob[i + nr * j] = t->yprob[i * nc + j];
+    }
+    return TREE_OK;
+}
+
+static void bag_free(BagTree *bt, int ntree)
+{
+    int b;
+
+    for (b = 0; b < ntree; b++) {
+	free(bt[b].node);
+	free(bt[b].cut);
+	bt[b].node = NULL;
+	bt[b].cut = NULL;
+    }
+}
+
+typedef struct {
+    BagTree *bt;
+    int ntree, nc;
+} BagList;
+
+static SEXP bag_make(void *data)
+{
+    BagList *bl = (BagList *) data;
+    BagTree *bt = bl->bt;
+    int b, i, nr;
+    const char *nms[] = {"node", "var", "cut", "lmask", "rmask", "n",
+			 "dev", "yval", "yprob"};
+    SEXP ans, tr, names, v;
+
+    PROTECT(ans = allocVector(VECSXP, bl->ntree));
+    PROTECT(names = allocVector(STRSXP, 9));
+    for (i = 0; i < 9; i++) SET_STRING_ELT(names, i, mkChar(nms[i]));
+    for (b = 0; b < bl->ntree; b++) {
+	nr = bt[b].nnode;
+	tr = allocVector(VECSXP, 9);
+	SET_VECTOR_ELT(ans, b, tr);
+	setAttrib(tr, R_NamesSymbol, names);
+	SET_VECTOR_ELT(tr, 0, v = allocVector(INTSXP, nr));
+	memcpy(INTEGER(v), bt[b].node, nr * sizeof(int));
+	SET_VECTOR_ELT(tr, 1, v = allocVector(INTSXP, nr));
+	memcpy(INTEGER(v), bt[b].var, nr * sizeof(int));
+	SET_VECTOR_ELT(tr, 2, v = allocVector(REALSXP, nr));
+	memcpy(REAL(v), bt[b].cut, nr * sizeof(double));
+	SET_VECTOR_ELT(tr, 3, v = allocMatrix(INTSXP, bt[b].nw, nr));
+	memcpy(INTEGER(v), bt[b].lmask, bt[b].nw * nr * sizeof(int));
+	SET_VECTOR_ELT(tr, 4, v = allocMatrix(INTSXP, bt[b].nw, nr));
+	memcpy(INTEGER(v), bt[b].rmask, bt[b].nw * nr * sizeof(int));
+	SET_VECTOR_ELT(tr, 5, v = allocVector(REALSXP, nr));
+	memcpy(REAL(v), bt[b].n, nr * sizeof(double));
+	SET_VECTOR_ELT(tr, 6, v = allocVector(REALSXP, nr));
+	memcpy(REAL(v), bt[b].dev, nr * sizeof(double));
+	SET_VECTOR_ELT(tr, 7, v = allocVector(REALSXP, nr));
+	memcpy(REAL(v), bt[b].yval, nr * sizeof(double));
+	if (bl->nc) {
+	    SET_VECTOR_ELT(tr, 8, v = allocMatrix(REALSXP, nr, bl->nc));
+	    memcpy(REAL(v), bt[b].yprob, nr * bl->nc * sizeof(double));
+	}
+    }
+    UNPROTECT(2);
+    return ans;
+}
+
+static void bag_clean(void *data)
+{
+    BagList *bl = (BagList *) data;
+
+    bag_free(bl->bt, bl->ntree);
+}
+
+/* the R list of the kept trees, freeing them even if an allocation
+   fails */
+static SEXP bag_list(BagTree *bt, int ntree, int nc)
+{
+    BagList bl;
+
+    bl.bt = bt;
+    bl.ntree = ntree;
+    bl.nc = nc;
+    return R_ExecWithCleanup(bag_make, &bl, bag_clean, &bl);
+}
+
+static int bag_one(Tree *proto, Sint *counts, unsigned int seed, BagTree *bt)
+{
+    Tree tr, *t = &tr;
+    double *w;
+    int j, nc = proto->levels[proto->nvar], res;
+
+    /* share the data set up in proto, with working storage of our own */
+    *t = *proto;
+    t->mem = NULL;
+    t->nmem = t->amem = 0;
+    t->seed = seed;
+    t->subset = counts;
+    w = (double *) malloc(t->nobs * sizeof(double));
+    t->where = (Sint *) malloc(t->nobs * sizeof(Sint));
+    t->node = (Sint *) malloc(2 * t->nmax * sizeof(Sint));
+    t->n = (double *) malloc((4 + nc) * (size_t) t->nmax * sizeof(double));
+    if (!w || !t->where || !t->node || !t->n) res = TREE_NOMEM;
+    else if ((res = tree_work(t)) == TREE_OK) {
+	for (j = 0; j < t->nobs; j++) w[j] = proto->w[j] * counts[j];
+	t->w = w;
+	t->var = t->node + t->nmax;
+	t->dev = t->n + t->nmax;
+	t->yval = t->dev + t->nmax;
+	t->yprob = t->yval + t->nmax;
+	res = tree_grow(t);
+    }
+    if (res == TREE_OK) res = bag_keep(t, bt);
+    tree_free(t);
+    free(w); free(t->where); free(t->node); free(t->n);
+    return res;
+}
+
+SEXP
+BDRbag(SEXP sX, SEXP sy, SEXP sw, SEXP slevels, SEXP sordered, SEXP sctrl,
+       SEXP smindev, SEXP scounts, SEXP sseeds)
+{
+    Tree proto;
+    BagTree *bt;
+    int b, nobs = LENGTH(sy), ntree = LENGTH(sseeds), nc, res;
+#ifdef _OPENMP
+    int nthreads;
+#endif
+
+    memset(&proto, 0, sizeof(Tree));
+    proto.y = REAL(sy); proto.w = REAL(sw);
+    proto.nobs = nobs; proto.nvar = LENGTH(slevels) - 1;
+    proto.levels = INTEGER(slevels); proto.ordered = INTEGER(sordered);
+    tree_data(&proto, sX);
+    tree_ctrl(&proto, sctrl);
+#ifdef _OPENMP
+    nthreads = proto.nthreads;
+#endif
+    proto.nthreads = 1;
+    proto.mindev = asReal(smindev);
+    nc = proto.levels[proto.nvar];
+    bt = (BagTree *) R_alloc(ntree, sizeof(BagTree));
+    memset(bt, 0, ntree * sizeof(BagTree));
+    if ((res = tree_prepare(&proto)) != TREE_OK) {
+	tree_free(&proto);
+	error("%s", tree_errmsg(res));
+    }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(max(nthreads, 1)) schedule(dynamic, 1) \
+    if(nthreads > 1 && ntree > 1)
+#endif
+    for (b = 0; b < ntree; b++)
+	bt[b].res = bag_one(&proto, INTEGER(scounts) + (size_t) b * nobs,
+			    (unsigned int) INTEGER(sseeds)[b], bt + b);
+    tree_free(&proto);
+    for (res = TREE_OK, b = 0; b < ntree; b++)
+	if (bt[b].res != TREE_OK) res = bt[b].res;
+    if (res != TREE_OK) {
+	bag_free(bt, ntree);
+	error("%s", tree_errmsg(res));
+    }
+    return bag_list(bt, ntree, nc);
+}
+
+/* Gradient boosting for squared error: ntree trees of depth at most
+   maxdepth, each grown to the residuals of the fit so far and added
+   with weight shrink.  One Tree is set up once (so X is sorted or
+   binned once) and regrown for each new y.  ctrl is as for tree_ctrl(),
+   with Gini unused.  The value is a list of the trees (as from
+   BDRbag, with yval already multiplied by shrink), the initial
+   constant, the fitted values and the deviance after each tree. */
+SEXP
+BDRboost(SEXP sX, SEXP sy, SEXP sw, SEXP slevels, SEXP sordered, SEXP sctrl,
+	 SEXP smindev, SEXP sntree, SEXP sshrink)
+{
+    Tree tr, *t = &tr;
+    BagTree *bt;
+    int b, i, j, nobs = LENGTH(sy), ntree = asInteger(sntree),
+	res = TREE_OK;
+    double *y = REAL(sy), *w = REAL(sw), *r, *f, *dev, shrink = asReal(sshrink),
+	sw0 = 0.0, init = 0.0, d;
+    const char *nms[] = {"trees", "init", "fitted", "dev"};
+    SEXP ans, names, sf, sdev, strees;
+
+    memset(t, 0, sizeof(Tree));
+    t->w = w;
+    t->nobs = nobs; t->nvar = LENGTH(slevels) - 1;
+    t->levels = INTEGER(slevels); t->ordered = INTEGER(sordered);
+    tree_data(t, sX);
+    if (t->levels[t->nvar]) error(_("boosting needs a numeric response"));
+    tree_ctrl(t, sctrl);
+    t->Gini = 0;
+    if (t->maxdepth < 1 || t->maxdepth > 30)
+	error(_("invalid depth for boosting"));
+    if (ntree == NA_INTEGER || ntree < 0 || !(shrink > 0))
+	error(_("invalid number of trees or shrinkage for boosting"));
+    t->mindev = asReal(smindev);
+    t->y = r = (double *) R_alloc(nobs, sizeof(double));
+    t->where = (Sint *) R_alloc(nobs, sizeof(Sint));
+    t->node = (Sint *) R_alloc(2 * t->nmax, sizeof(Sint));
+    t->var = t->node + t->nmax;
+    t->n = (double *) R_alloc(3 * t->nmax, sizeof(double));
+    t->dev = t->n + t->nmax;
+    t->yval = t->dev + t->nmax;
+    bt = (BagTree *) R_alloc(ntree, sizeof(BagTree));
+    memset(bt, 0, ntree * sizeof(BagTree));
+    PROTECT(sf = allocVector(REALSXP, nobs));
+    PROTECT(sdev = allocVector(REALSXP, ntree));
+    f = REAL(sf);
+    dev = REAL(sdev);
+
+    for (j = 0; j < nobs; j++) {
+	sw0 += w[j];
+	init += w[j] * y[j];
+    }
+    if (sw0 > 0) init /= sw0;
+    for (j = 0; j < nobs; j++) {
+	f[j] = init;
+	r[j] = y[j] - init;
+    }
+    for (b = 0; b < ntree; b++) {
+	t->nnode = 0;
+	if ((res = tree_grow(t)) != TREE_OK) break;
+	for (i = 0; i < t->nnode; i++) t->yval[i] *= shrink;
+	if ((res = bag_keep(t, bt + b)) != TREE_OK) break;
+	for (d = 0.0, j = 0; j < nobs; j++) {
+	    f[j] += t->yval[t->where[j] - 1];
+	    r[j] = y[j] - f[j];
+	    d += w[j] * r[j] * r[j];
+	}
+	dev[b] = d;
+    }
+    tree_free(t);
+    if (res != TREE_OK) {
+	bag_free(bt, ntree);
+	error("%s", tree_errmsg(res));
+    }
+
+    PROTECT(strees = bag_list(bt, ntree, 0));
+    PROTECT(ans = allocVector(VECSXP, 4));
+    PROTECT(names = allocVector(STRSXP, 4));
+    for (i = 0; i < 4; i++) SET_STRING_ELT(names, i, mkChar(nms[i]));
+    setAttrib(ans, R_NamesSymbol, names);
+    SET_VECTOR_ELT(ans, 0, strees);
+    SET_VECTOR_ELT(ans, 1, ScalarReal(init));
+    SET_VECTOR_ELT(ans, 2, sf);
+    SET_VECTOR_ELT(ans, 3, sdev);
+    UNPROTECT(5);
+    return ans;
+}
@@ -26,20 +26,37 @@
 #define CDEF(name, n)  {#name, (DL_FUNC) &name, n}
 
 static const R_CMethodDef CEntries[]  = {
-    CDEF(BDRgrow1, 23),
+    CDEF(BDRgrow1, 24),
+    CDEF(VR_topology, 5),
     CDEF(VR_dev1, 12),
     CDEF(VR_dev2, 10),
     CDEF(VR_dev3, 10),
     CDEF(VR_prune2, 17),
+    CDEF(VR_cvtree, 19),
     CDEF(VR_pred1, 11),
-    CDEF(VR_pred2, 10),
+    CDEF(VR_pred3, 14),
+    {NULL, NULL, 0}
+};
+
+#define CALLDEF(name, n)  {#name, (DL_FUNC) &name, n}
+
+static const R_CallMethodDef CallEntries[] = {
+    CALLDEF(BDRgrow2, 8),
+    CALLDEF(VR_pred4, 11),
+    CALLDEF(VR_predens, 6),
+    CALLDEF(BDRbag, 9),
+    CALLDEF(BDRboost, 9),
+    CALLDEF(VR_treesave, 12),
+    CALLDEF(VR_treemap, 2),
+    CALLDEF(VR_treeinfo, 1),
+    CALLDEF(VR_predmap, 5),
     {NULL, NULL, 0}
 };
 
 
 void R_init_tree(DllInfo *dll)
 {
-    R_registerRoutines(dll, CEntries, NULL, NULL, NULL);
+    R_registerRoutines(dll, CEntries, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
 #if defined(R_VERSION) && R_VERSION >= R_Version(2, 16, 0)
     R_forceSymbols(dll, TRUE);
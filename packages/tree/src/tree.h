@@ -16,13 +16,119 @@
  */
 
 #include <R.h>
+#include <Rinternals.h>
+
+/* Error codes of tree_grow() */
+#define TREE_OK 0
+#define TREE_NOMEM 1
+#define TREE_BIG 2
+#define TREE_DEPTH 3
+#define TREE_GININA 4
+#define TREE_LEVELS 5
+#define TREE_SINGLE 6
+
+/* All the state of growing one tree, so that several trees can be grown
+   at once, e.g. from different threads.  The caller sets the data,
+   control and node arrays (nmax long, yprob nmax*nc, where nobs long) and
+   nnode; the rest is working storage owned by tree_grow(). */
+typedef struct {
+    /* data: levels[nvar] is the number of classes, 0 for regression.
+       The predictors are the nobs x nvar matrix X or, if X is NULL, the
+       columns xcol[iv], or for factors the integer codes xcode[iv]
+       (NA_INTEGER if missing) if xcode and xcode[iv] are not NULL, or
+       single-precision values (NaN if missing) if xflt and xflt[iv] are.
+       If subset is not NULL only the cases with subset[j] != 0 are used,
+       and the others have where 0 */
+    double *X, *y, *w, **xcol;
+    int **xcode;
+    float **xflt;
+    int nobs, nvar;
+    Sint *levels, *ordered, *subset;
+    /* control: engine 0 sort, 1 presort, 2 hist.  If 0 < mtry < nvar
+       each node searches only mtry variables chosen at random, from the
+       generator seeded by seed.  Nodes are not split below depth
+       maxdepth if that is positive.  fsplit 1: unordered factors for
+       more than two classes are split along their levels ordered by the
+       first principal component of the class proportions, rather than
+       trying all splits.  If maxleaves > 0 the tree is grown best-first,
+       splitting the leaf that most reduces the deviance next, to at most
+       maxleaves leaves */
+    int minsize, mincut, nmax, Gini, engine, nbins, nthreads, mtry,
+	maxdepth, fsplit, maxleaves;
+    unsigned int seed;
+    double mindev;
+    /* the tree: if readonly the nnode nodes given are only read */
+    int nnode, readonly;
+    Sint *node, *var, *where;
+    double *n, *dev, *yval, *yprob;
+    /* the splits: threshold, or bitmasks of the levels going left and
+       right in nw words per node; orig is the input index of a node not
+       (re)split here, or -1 */
+    double *cut;
+    unsigned int *lmask, *rmask;
+    int *orig, nw;
+
+    /* working storage */
+    int nc, exists, maxnl, *ttw, *vuse;
+    double devtarget;
+    struct Scratch *scr;
+    struct Split *cand;
+    /* The cases of node i are perm[nbeg[i]] .. perm[nend[i]-1], in
+       increasing order; a split partitions the range stably in place.
+       presort engine: each continuous column sorted once, NAs last, and
+       partitioned in the same way, from its order xord */
+    int *perm, *nbeg, *nend, *tpart, presort, **sorted, **xord, *rcur;
+    /* histogram engine: continuous columns coded into at most 255 bins
+       in xbin, NA as 255.  A node histogram holds 256 slots per variable
+       of hstride doubles: count, weight, then class weights or w*y and
+       w*y^2 */
+    int hist, hstride, hsize, *hoff, *nbin, nhfree;
+    unsigned char *xbin;
+    double *bmin, *bmax, **hfree;
+    /* the pool of ncap nodes, in the order made, node i having
+       children kid[i] and kid[i] + 1; for best-first growth the split
+       found for each leaf waiting in the heap, by gain, and its
+       histogram hnode[i] */
+    int ncap, *kid, *bvar, *heap, nheap;
+    double *hgain, *pn, *pdev, *pyval, *pyprob, **hnode;
+    Sint *pnode, *pvar;
+    void **mem;
+    int nmem, amem, ready;
+} Tree;
+
+/* A compiled tree in the binary form of treeio.c, pointing into the
+   mapped file: as from compile.tree(), with the numbers of levels of
+   the nvar variables, the fitted values yval (class codes if nc > 0),
+   the nnode x nc matrix yprob and the strings nstr bytes long */
+typedef struct {
+    int nnode, nvar, nw, nc, single;
+    Sint *var, *left, *right, *lmask, *rmask, *nlevels;
+    double *cut, *yval, *yprob;
+    const char *str;
+    size_t nstr;
+} TreeModel;
+
+void tree_model(SEXP sptr, TreeModel *tm);
+
+int tree_setup(Tree *t);
+int tree_grow(Tree *t);
+void tree_free(Tree *t);
+const char *tree_errmsg(int res);
+
 void 
 BDRgrow1(double *pX, double *pY, double *pw, Sint *plevels, Sint *junk1, 
 	 Sint *pnobs, Sint *pncol, Sint *pnode, Sint *pvar, char **pcutleft, 
 	 char **pcutright, double *pn, double *pdev, double *pyval, 
 	 double *pyprob, Sint *pminsize, Sint *pmincut, double *pmindev, 
-	 Sint *pnnode, Sint *pwhere, Sint *pnmax, Sint *stype, Sint *pordered);
+	 Sint *pnnode, Sint *pwhere, Sint *pnmax, Sint *stype, Sint *pordered,
+	 Sint *pctrl);
+
+SEXP
+BDRgrow2(SEXP sX, SEXP sy, SEXP sw, SEXP slevels, SEXP sordered, SEXP sctrl,
+	 SEXP smindev, SEXP sold);
 
+void VR_topology(Sint *nnode, Sint *nodes, Sint *parent, Sint *left,
+		 Sint *right);
 
 void VR_dev1(Sint *nnode, Sint *nodes, Sint *parent, 
 	     double *dev, double *sdev,
@@ -43,19 +149,47 @@ VR_prune2(Sint *nnode, Sint *nodes, Sint *leaf, double *dev, double *sdev,
 	  Sint *size, double *cdev, double *alph, Sint *inodes, Sint *tsize,
 	  double *tdev, double *ntdev);
 
+void
+VR_cvtree(double *X, double *y, double *w, Sint *levels, Sint *ordered,
+	  Sint *pnobs, Sint *pnvar, Sint *fold, Sint *pnfold, Sint *pminsize,
+	  Sint *pmincut, double *pmindev, Sint *pctrl, Sint *pmethod,
+	  double *loss, double *peps, double *k, Sint *pnk, double *cvdev);
+
 void    
 VR_pred1(double *x, Sint *vars, char **lsplit, char **rsplit,
 	 Sint *nlevels, Sint *nodes, Sint *fn, Sint *nnode,
 	 Sint *nr, Sint *nc, Sint *where);
 
-void    
-VR_pred2(double *px, Sint *pvars, char **plsplit, char **prsplit,
-	 Sint *pnlevels, Sint *pnodes, Sint *fn, Sint *pnnode,
-	 Sint *nr, double *pwhere);
+void
+VR_pred3(double *x, Sint *pnobs, Sint *vars, Sint *left, Sint *right,
+	 double *cut, Sint *lmask, Sint *rmask, Sint *pnw, Sint *nlevels,
+	 Sint *pnnode, Sint *pnthreads, Sint *where, Sint *pfloat);
+
+SEXP
+VR_pred4(SEXP sx, SEXP svar, SEXP sleft, SEXP sright, SEXP scut,
+	 SEXP slmask, SEXP srmask, SEXP snlevels, SEXP sfn, SEXP ssingle,
+	 SEXP snthreads);
 
+SEXP
+VR_predens(SEXP sx, SEXP strees, SEXP snlevels, SEXP snc, SEXP ssum,
+	   SEXP snthreads);
 
+SEXP
+BDRbag(SEXP sX, SEXP sy, SEXP sw, SEXP slevels, SEXP sordered, SEXP sctrl,
+       SEXP smindev, SEXP scounts, SEXP sseeds);
 
+SEXP
+BDRboost(SEXP sX, SEXP sy, SEXP sw, SEXP slevels, SEXP sordered, SEXP sctrl,
+	 SEXP smindev, SEXP sntree, SEXP sshrink);
 
+SEXP
+VR_treesave(SEXP sfile, SEXP svar, SEXP sleft, SEXP sright, SEXP scut,
+	    SEXP slmask, SEXP srmask, SEXP snlevels, SEXP syval, SEXP syprob,
+	    SEXP sstr, SEXP ssingle);
 
+SEXP VR_treemap(SEXP sfile, SEXP sverify);
 
+SEXP VR_treeinfo(SEXP sptr);
 
+SEXP
+VR_predmap(SEXP sptr, SEXP sx, SEXP snobs, SEXP stype, SEXP snthreads);
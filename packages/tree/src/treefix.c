@@ -21,10 +21,21 @@
 #include <math.h>
 #include <stddef.h>
 #include <R.h>
+#include <Rinternals.h>
 #include <stdio.h>
 #include <string.h> /* for strchr */
+#include <stdlib.h>
+#include "tree.h"
 
 # include <R_ext/Utils.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef max
+# define max(a, b) ((a > b)?a:b)
+# define min(a, b) ((a < b)?a:b)
+#endif
 
 #ifndef Salloc
 #  define Salloc(n, t) (t *)S_alloc(n, sizeof(t))
@@ -40,176 +51,425 @@ static int mysum(Sint *vec, int n)
     return (s);
 }
 
-void VR_dev1(Sint *nnode, Sint *nodes, Sint *parent, 
-	     double *dev, double *sdev,
-	     Sint *y, Sint *ny, Sint *yf, Sint *where, double *wt,
-	     Sint *nc, double *loss)
+/* The topology of a tree from its node numbers, the children of node k
+   being 2k and 2k+1: the parent, left and right child indices (C indexed,
+   -1 if none) of each node; any of these may be NULL.  The node numbers
+   are looked up in a hash table, so this is linear in the size: hash is
+   scratch of HASHSIZE(nnode) ints, or NULL to allocate it. */
+#define HASHSIZE(n) (4 * (n) + 16)
+
+static void
+topology(Sint *nodes, int nnode, Sint *parent, Sint *left, Sint *right,
+	 int *hash)
 {
-    int i, j, wh, nn, nr = *nnode, nclass = *nc;
-	
-    parent[0] = -1;
-    for (i = 1; i < nr; i++)
-    {
-	nn = nodes[i]/2;
-	for (j = 0; j < i; j++)
-	    if(nodes[j] == nn) {parent[i] = j; break;}
+    int     i, k, p;
+    unsigned int h, m;
+
+    for (m = 16; m < 2 * (unsigned int) nnode; m *= 2);
+    if (!hash) hash = Salloc(m, int);
+    for (h = 0; h < m; h++) hash[h] = -1;
+    m--;
+    for (i = 0; i < nnode; i++) {
+	for (h = (unsigned int) nodes[i] * 2654435761U; hash[h & m] >= 0; h++);
+	hash[h & m] = i;
+    }
+    for (i = 0; i < nnode; i++) {
+	if (left) left[i] = -1;
+	if (right) right[i] = -1;
+    }
+    for (i = 0; i < nnode; i++) {
+	k = nodes[i] / 2;
+	p = -1;
+	if (k > 0)
+	    for (h = (unsigned int) k * 2654435761U; hash[h & m] >= 0; h++)
+		if (nodes[hash[h & m]] == k) {
+		    p = hash[h & m];
+		    break;
+		}
+	if (parent) parent[i] = p;
+	if (p < 0) continue;
+	if (nodes[i] % 2 == 0) {
+	    if (left) left[p] = i;
+	} else if (right) right[p] = i;
     }
-    for (i = 0; i < nr; i++) dev[i] = sdev[i] = 0.0;
-    for (j = 0; j < *ny; j++)
+}
+
+void VR_topology(Sint *nnode, Sint *nodes, Sint *parent, Sint *left,
+		 Sint *right)
+{
+    topology(nodes, *nnode, parent, left, right, NULL);
+}
+
+/* The deviance routines take parent[] from compile.tree() if parent[0]
+   is -1, and otherwise work it out.  sdev is the deviance of the cases
+   at each node and dev that of the cases at or below it: the latter is
+   found from sufficient statistics of the cases at each node, added
+   into the parents in decreasing order of node number, rather than by
+   adding each case into all its ancestors.  The static versions take
+   their scratch from the caller, so can be used from several threads. */
+
+/* the node indices in increasing order of node number, using scratch nd */
+static void
+node_order(Sint *nodes, int nr, int *ord, int *nd)
+{
+    int     i;
+
+    for (i = 0; i < nr; i++) {
+	nd[i] = nodes[i];
+	ord[i] = i;
+    }
+    R_qsort_int_I(nd, ord, 1, nr);
+}
+
+/* the class totals of the cases at or below each node */
+static void
+class_totals(int nr, Sint *parent, int *ord, Sint *y, int ny, Sint *where,
+	     double *wt, int nclass, double *cnt)
+{
+    int     i, j, k, p;
+
+    for (i = 0; i < nr * nclass; i++) cnt[i] = 0.0;
+    for (j = 0; j < ny; j++)
+	cnt[nclass * (where[j] - 1) + y[j] - 1] += wt[j];
+    for (k = nr - 1; k > 0; k--) {
+	i = ord[k];
+	if ((p = parent[i]) < 0) continue;
+	for (j = 0; j < nclass; j++)
+	    cnt[nclass * p + j] += cnt[nclass * i + j];
+    }
+}
+
+/* misclassification loss; cnt is nr * nclass */
+static void
+dev_loss(int nr, Sint *parent, int *ord, double *dev, double *sdev,
+	 Sint *y, int ny, Sint *yf, Sint *where, double *wt, int nclass,
+	 double *loss, double *cnt)
+{
+    int i, j, wh;
+    double sum;
+
+    for (i = 0; i < nr; i++) sdev[i] = 0.0;
+    for (j = 0; j < ny; j++)
     {
 	wh = where[j] - 1; /* C indexed */
 	sdev[wh] += wt[j] * loss[y[j] - 1 + nclass*(yf[wh]-1)];
-	dev[wh] += wt[j] * loss[y[j] - 1 + nclass*(yf[wh]-1)];
-	while((wh = parent[wh]) >= 0) 
-	    dev[wh] += wt[j] * loss[y[j] - 1 + nclass*(yf[wh]-1)];
+    }
+    class_totals(nr, parent, ord, y, ny, where, wt, nclass, cnt);
+    for (i = 0; i < nr; i++) {
+	sum = 0.0;
+	for (j = 0; j < nclass; j++)
+	    sum += cnt[nclass * i + j] * loss[j + nclass*(yf[i]-1)];
+	dev[i] = sum;
     }
 }
 
-void VR_dev2(Sint *nnode, Sint *nodes, Sint *parent, 
-	     double *dev, double *sdev,
-	     Sint *y, Sint *ny, double *yprob, Sint* where, double *wt)
+/* log-likelihood; cnt is nr * nclass */
+static void
+dev_logp(int nr, Sint *parent, int *ord, double *dev, double *sdev,
+	 Sint *y, int ny, double *yprob, Sint *where, double *wt, int nclass,
+	 double *cnt)
 {
-    int i, j, wh, nn, nr = *nnode;
-    double tmp;
-	
-    parent[0] = -1;
-    for (i = 1; i < nr; i++)
-    {
-	nn = nodes[i]/2;
-	for (j = 0; j < i; j++)
-	    if(nodes[j] == nn) {parent[i] = j; break;}
-    }
-    for (i = 0; i < nr; i++) dev[i] = sdev[i] = 0.0;
-    for (j = 0; j < *ny; j++)
+    int i, j, wh;
+    double tmp, sum;
+
+    for (i = 0; i < nr; i++) sdev[i] = 0.0;
+    for (j = 0; j < ny; j++)
     {
 	wh = where[j] - 1; /* C indexed */
 	safe_log(tmp, yprob[wh + nr*(y[j]-1)]);
 	sdev[wh] += wt[j] * tmp;
-	dev[wh] += wt[j] * tmp;
-	while((wh = parent[wh]) >= 0) {	  
-	    safe_log(tmp, yprob[wh + nr*(y[j]-1)]);
-	    dev[wh] += wt[j] * tmp;
+    }
+    class_totals(nr, parent, ord, y, ny, where, wt, nclass, cnt);
+    for (i = 0; i < nr; i++) {
+	sum = 0.0;
+	for (j = 0; j < nclass; j++) {
+	    safe_log(tmp, yprob[i + nr*j]);
+	    sum += cnt[nclass * i + j] * tmp;
 	}
-		
+	dev[i] = sum;
     }
 }
 
 # define sqr(x) (x) * (x)
+/* residual sum of squares; work is 3 * nr */
+static void
+dev_sq(int nr, Sint *parent, int *ord, double *dev, double *sdev,
+       double *y, int ny, double *yf, Sint *where, double *wt, double *work)
+{
+    int i, j, k, p, wh;
+    double *W = work, *m = work + nr, *M2 = work + 2 * nr, d, tot;
+
+    for (i = 0; i < nr; i++) sdev[i] = W[i] = m[i] = M2[i] = 0.0;
+    /* weighted means and sums of squares about them, by Welford's
+       updates over the cases and Chan's formula over the nodes */
+    for (j = 0; j < ny; j++)
+    {
+	wh = where[j] - 1; /* C indexed */
+	sdev[wh] += wt[j] * sqr(y[j] - yf[wh]);
+	if (wt[j] == 0.0) continue;
+	W[wh] += wt[j];
+	d = y[j] - m[wh];
+	m[wh] += wt[j] * d / W[wh];
+	M2[wh] += wt[j] * d * (y[j] - m[wh]);
+    }
+    for (k = nr - 1; k > 0; k--) {
+	i = ord[k];
+	if ((p = parent[i]) < 0 || W[i] == 0.0) continue;
+	tot = W[p] + W[i];
+	d = m[i] - m[p];
+	m[p] += d * W[i] / tot;
+	M2[p] += M2[i] + d * d * W[p] * W[i] / tot;
+	W[p] = tot;
+    }
+    for (i = 0; i < nr; i++) dev[i] = M2[i] + W[i] * sqr(m[i] - yf[i]);
+}
+
+static int *
+up_order(Sint *nodes, int nr, Sint *parent)
+{
+    int     *ord = Salloc(nr, int);
+
+    if (parent[0] != -1) topology(nodes, nr, parent, NULL, NULL, NULL);
+    node_order(nodes, nr, ord, Salloc(nr, int));
+    return ord;
+}
+
+void VR_dev1(Sint *nnode, Sint *nodes, Sint *parent, 
+	     double *dev, double *sdev,
+	     Sint *y, Sint *ny, Sint *yf, Sint *where, double *wt,
+	     Sint *nc, double *loss)
+{
+    int *ord = up_order(nodes, *nnode, parent);
+
+    dev_loss(*nnode, parent, ord, dev, sdev, y, *ny, yf, where, wt, *nc,
+	     loss, Salloc(*nnode * *nc, double));
+}
+
+void VR_dev2(Sint *nnode, Sint *nodes, Sint *parent, 
+	     double *dev, double *sdev,
+	     Sint *y, Sint *ny, double *yprob, Sint* where, double *wt)
+{
+    int j, nclass = 0, *ord = up_order(nodes, *nnode, parent);
+
+    for (j = 0; j < *ny; j++) nclass = max(nclass, y[j]);
+    dev_logp(*nnode, parent, ord, dev, sdev, y, *ny, yprob, where, wt,
+	     nclass, Salloc(*nnode * nclass, double));
+}
+
 void VR_dev3(Sint *nnode, Sint *nodes, Sint *parent, 
 	     double *dev, double *sdev,
 	     double *y, Sint *ny, double *yf, Sint* where, double *wt)
 {
-    int i, j, wh, nn, nr = *nnode;
-	
-    parent[0] = -1;
-    for (i = 1; i < nr; i++)
-    {
-	nn = nodes[i]/2;
-	for (j = 0; j < i; j++)
-	    if(nodes[j] == nn) {parent[i] = j; break;}
+    int *ord = up_order(nodes, *nnode, parent);
+
+    dev_sq(*nnode, parent, ord, dev, sdev, y, *ny, yf, where, wt,
+	   Salloc(3 * *nnode, double));
+}
+
+/* Indexed binary heap of nodes on g, for the weakest-link pruning:
+   hp[0..*nh-1] holds the nodes, pos[i] the position of node i or -1 */
+static void heap_up(int *hp, int *pos, double *g, int k)
+{
+    int i = hp[k], p;
+
+    while (k > 0 && g[hp[p = (k - 1) / 2]] > g[i]) {
+	hp[k] = hp[p];
+	pos[hp[k]] = k;
+	k = p;
     }
-    for (i = 0; i < nr; i++) dev[i] = sdev[i] = 0.0;
-    for (j = 0; j < *ny; j++)
-    {
-	wh = where[j] - 1; /* C indexed */
-	sdev[wh] += wt[j] * sqr(y[j] - yf[wh]);
-	dev[wh] += wt[j] * sqr(y[j] - yf[wh]);
-	while((wh = parent[wh]) >= 0) {
-	    dev[wh] += wt[j] * sqr(y[j] - yf[wh]);
-	}
+    hp[k] = i;
+    pos[i] = k;
+}
+
+static void heap_down(int *hp, int *pos, double *g, int nh, int k)
+{
+    int i = hp[k], c;
+
+    while ((c = 2 * k + 1) < nh) {
+	if (c + 1 < nh && g[hp[c + 1]] < g[hp[c]]) c++;
+	if (g[hp[c]] >= g[i]) break;
+	hp[k] = hp[c];
+	pos[hp[k]] = k;
+	k = c;
     }
+    hp[k] = i;
+    pos[i] = k;
 }
 
-void    
-VR_prune2(Sint *nnode, Sint *nodes, Sint *leaf, double *dev, double *sdev,
+static void heap_remove(int *hp, int *pos, double *g, int *nh, int i)
+{
+    int k = pos[i], m;
+
+    pos[i] = -1;
+    if (k == --(*nh)) return;
+    m = hp[k] = hp[*nh];
+    heap_up(hp, pos, g, k);
+    heap_down(hp, pos, g, *nh, pos[m]);
+}
+
+/* cdev and size of internal node i from those of its children, and
+   hence its g */
+static void
+prune_node(int i, int *left, int *right, double *dev, double *sdev,
+	   double *cdev, Sint *size, double *g)
+{
+    double  rt = sdev[i];
+    int     sz = 0;
+
+    if (left[i] >= 0) {
+	rt += cdev[left[i]];
+	sz += size[left[i]];
+    }
+    if (right[i] >= 0) {
+	rt += cdev[right[i]];
+	sz += size[right[i]];
+    }
+    size[i] = sz;
+    g[i] = (dev[i] - rt) / (sz - 1);
+    cdev[i] = rt;
+}
+
+/* The deviance of the subtree of the kept nodes, summed over the nodes
+   in order */
+static double
+subtree_dev(int nr, Sint *leaf, Sint *keep, double *dev, double *sdev)
+{
+    int     j;
+    double  sum = 0;
+
+    for (j = 0; j < nr; j++)
+	if (leaf[j]) sum += dev[j];
+	else if (keep[j]) sum += sdev[j];
+    return sum;
+}
+
+/* The cost-complexity pruning sequence.  All the internal nodes whose g
+   is within EPS of the smallest are pruned together, in increasing order
+   of node number (ord), as the full tree was evaluated; after a prune
+   only the totals of its ancestors are updated, and the next weakest
+   links are taken from a heap.  The deviances of the subtrees are
+   summed over the nodes, in the same order as the full evaluation, so
+   the sequence is the same to the last bit.  iw is scratch of
+   PRUNE_IW(nr) ints and dw of nr doubles; the length of the sequence
+   is returned. */
+#define PRUNE_IW(n) (7 * (n) + HASHSIZE(n))
+
+static int
+prune_seq(int nr, Sint *nodes, Sint *leaf, double *dev, double *sdev,
 	  double *ndev, double *nsdev, Sint *keep, Sint *ord, double *g,
 	  Sint *size, double *cdev, double *alph, Sint *inodes, Sint *tsize,
-	  double *tdev, double *ntdev)
+	  double *tdev, double *ntdev, int *iw, double *dw)
 {
-    int     i, in, ir, j, k, cur, nr = *nnode, sz, First, na = 0;
-    double  alpha = 0.0, rt, sum;
+    int     i, j, k, cur, na = 0, nh = 0, nc, nkeep = nr,
+	    nleaf, *left, *right, *parent, *stk, sp, *hp, *pos, *cand;
+    double  alpha, *crank;
 
+    left = iw;
+    right = iw + nr;
+    parent = iw + 2 * nr;
+    stk = iw + 3 * nr;
+    hp = iw + 4 * nr;
+    pos = iw + 5 * nr;
+    cand = iw + 6 * nr;
+    crank = dw;
+    topology(nodes, nr, parent, left, right, iw + 7 * nr);
     for (i = 0; i < nr; i++) keep[i] = True;
     /* start with full tree */
     inodes[na] = 0;
     alph[na] = -1.0e+200;
-    tsize[na] = mysum(leaf, nr);
-    sum = 0;
-    for (j = 0; j < nr; j++)
-	if (leaf[j]) sum += ndev[j];
-	else if (keep[j]) sum += nsdev[j];	/* presumably all kept */
-    ntdev[na] = sum;
-    sum = 0;
-    for (j = 0; j < nr; j++)
-	if (leaf[j]) sum += dev[j];
-	else if (keep[j]) sum += sdev[j];
-    tdev[na++] = sum;
+    tsize[na] = nleaf = mysum(leaf, nr);
+    ntdev[na] = subtree_dev(nr, leaf, keep, ndev, nsdev);
+    tdev[na++] = subtree_dev(nr, leaf, keep, dev, sdev);
 
-    do {
-	First = True;
-	for (i = 0; i < nr; i++) {
-	    cdev[i] = dev[i];
-	    size[i] = 1;
+    for (i = 0; i < nr; i++) {
+	cdev[i] = dev[i];
+	size[i] = 1;
+	pos[i] = -1;
+    }
+    for (k = nr - 1; k >= 0; k--) {
+	cur = ord[k] - 1;
+	if (leaf[cur]) continue;
+	prune_node(cur, left, right, dev, sdev, cdev, size, g);
+	hp[nh] = cur;
+	heap_up(hp, pos, g, nh++);
+    }
+
+    while (nkeep > 1 && nh > 0) {
+	alpha = g[hp[0]];
+	nc = 0;
+	while (nh > 0 && fabs(g[hp[0]] - alpha) < EPS * (1 + fabs(alpha))) {
+	    cand[nc] = hp[0];
+	    crank[nc++] = nodes[hp[0]];
+	    heap_remove(hp, pos, g, &nh, hp[0]);
 	}
-	for (k = nr - 1; k >= 0; k--) {
-	    cur = ord[k] - 1;
-	    if (keep[cur] && !leaf[cur]) {
-		/* sum over descendants */
-		rt = sdev[cur];
-		sz = 0;
-		ir = nodes[cur];
-		for (j = 0; j < nr; j++)
-		    if (nodes[j] / 2 == ir) {
-			rt += cdev[j];
-			sz += size[j];
-		    }
-		size[cur] = sz;
-		g[cur] = (dev[cur] - rt) / (sz - 1);
-		cdev[cur] = rt;
-		if (First) {
-		    First = False;
-		    alpha = g[cur];
+	if (nc > 1) R_qsort_I(crank, cand, 1, nc);
+	for (k = 0; k < nc; k++) {
+	    cur = cand[k];
+	    if (!keep[cur]) continue;	/* below one pruned this round */
+	    /* prune at cur */
+	    leaf[cur] = True;
+	    alph[na] = alpha;
+	    inodes[na] = nodes[cur];
+	    /* drop the descendants */
+	    sp = 0;
+	    if (left[cur] >= 0) stk[sp++] = left[cur];
+	    if (right[cur] >= 0) stk[sp++] = right[cur];
+	    while (sp > 0) {
+		j = stk[--sp];
+		keep[j] = False;
+		nkeep--;
+		if (leaf[j]) {
+		    /* anything below was dropped when j was pruned */
+		    leaf[j] = False;
+		    continue;
 		}
-		else if (g[cur] < alpha) alpha = g[cur];
+		if (pos[j] >= 0) heap_remove(hp, pos, g, &nh, j);
+		if (left[j] >= 0) stk[sp++] = left[j];
+		if (right[j] >= 0) stk[sp++] = right[j];
 	    }
-	}
-	for (k = 0; k < nr; k++) {
-	    cur = ord[k] - 1;
-	    if (keep[cur] && !leaf[cur] &&
-		fabs(g[cur] - alpha) < EPS * (1 + fabs(alpha))) {
-		/* prune at cur */
-		leaf[cur] = True;
-		alph[na] = alpha;
-		ir = nodes[cur];
-		inodes[na] = ir;
-		for (j = 0; j < nr; j++)
-		    if (keep[j]) {
-			in = nodes[j];
-			if (in >= 2 * ir) {
-			    while (in >= 2 * ir) in = in / 2;
-			    if (in == ir) {
-				keep[j] = False;
-				leaf[j] = False;
-			    }
-			}
-		    }
-		tsize[na] = mysum(leaf, nr);
-		sum = 0;
-		for (j = 0; j < nr; j++)
-		    if (leaf[j]) sum += ndev[j];
-		    else if (keep[j]) sum += nsdev[j];
-		ntdev[na] = sum;
-		sum = 0;
-		for (j = 0; j < nr; j++)
-		    if (leaf[j])
-			sum += dev[j];
-		    else if (keep[j])
-			sum += sdev[j];
-		tdev[na++] = sum;
+	    nleaf += 1 - size[cur];
+	    cdev[cur] = dev[cur];
+	    size[cur] = 1;
+	    for (j = parent[cur]; j >= 0; j = parent[j]) {
+		prune_node(j, left, right, dev, sdev, cdev, size, g);
+		heap_up(hp, pos, g, pos[j]);
+		heap_down(hp, pos, g, nh, pos[j]);
 	    }
+	    tsize[na] = nleaf;
+	    ntdev[na] = subtree_dev(nr, leaf, keep, ndev, nsdev);
+	    tdev[na++] = subtree_dev(nr, leaf, keep, dev, sdev);
 	}
-    } while (mysum(keep, nr) > 1);
-    *nnode = na;
+    }
+    return na;
+}
+
+void    
+VR_prune2(Sint *nnode, Sint *nodes, Sint *leaf, double *dev, double *sdev,
+	  double *ndev, double *nsdev, Sint *keep, Sint *ord, double *g,
+	  Sint *size, double *cdev, double *alph, Sint *inodes, Sint *tsize,
+	  double *tdev, double *ntdev)
+{
+    int nr = *nnode;
+
+    *nnode = prune_seq(nr, nodes, leaf, dev, sdev, ndev, nsdev, keep, ord,
+		       g, size, cdev, alph, inodes, tsize, tdev, ntdev,
+		       Salloc(PRUNE_IW(nr), int), Salloc(nr, double));
+}
+
+/* Is level l (from 0) in the split label lab: ":" and a-z0-5, or ":#"
+   and a hex digit for each 4 levels? */
+static int label_has(const char *lab, int l)
+{
+    static const char lt[] = "abcdefghijklmnopqrstuvwxyz012345";
+    int d;
+
+    if (lab[1] == '#') {
+	if (l < 0 || l / 4 >= (int) strlen(lab + 2)) return False;
+	d = lab[2 + l / 4];
+	d = (d >= 'a') ? d - 'a' + 10 : d - '0';
+	return d >> (l % 4) & 1;
+    }
+    return l >= 0 && l < 32 && strchr(lab + 1, lt[l]) != NULL;
 }
 
 /* Take each case and drop it down the tree as needed */
@@ -219,26 +479,17 @@ VR_pred1(double *x, Sint *vars, char **lsplit, char **rsplit,
 	 Sint *nlevels, Sint *nodes, Sint *fn, Sint *nnode,
 	 Sint *nr, Sint *nc, Sint *where)
 {
-    int     nobs = *nr, cur, i, k, goleft, ival, cnode, var, *left, *right;
+    int     nobs = *nr, cur, i, goleft, ival, var, *left, *right;
     double  val, sp;
 
     left = Salloc(*nnode, int);
     right = Salloc(*nnode, int);
-    for (i = 0; i < *nnode; i++)
-	if (vars[i] > 0) {
-	    cnode = nodes[i];
-            left[i] = *nnode; /* protect against corrupted tree */
-            right[i] = *nnode;
-	    for (k = i + 1; k < *nnode; k++) {
-		if (nodes[k] == 2 * cnode) left[i] = k;
-		if (nodes[k] == 2 * cnode + 1) right[i] = k;
-	    }
-	}
+    topology(nodes, *nnode, NULL, left, right, NULL);
 
     for (i = 0; i < nobs; i++) {
 	cur = 0;			/* current node, C indexed */
 	while (True) {
-	    if (cur >= *nnode)
+	    if (cur < 0 || cur >= *nnode)
 		PROBLEM "corrupt tree" RECOVER(NULL_ENTRY);
 	    if (vars[cur] == 0) {	/* at a leaf */
 		where[i] = cur + 1;
@@ -259,10 +510,10 @@ VR_pred1(double *x, Sint *vars, char **lsplit, char **rsplit,
 		goleft = (val < sp);
 	    }
 	    else {
-		ival = 'a' + (int) val - 1;
-		if (strchr(lsplit[cur], ival) != NULL)
+		ival = (int) val - 1;
+		if (label_has(lsplit[cur], ival))
 		    goleft = True;
-		else if (strchr(rsplit[cur], ival) != NULL)
+		else if (label_has(rsplit[cur], ival))
 		    goleft = False;
 		else {		/* unforeseen level */
 		    where[i] = cur + 1;
@@ -275,90 +526,658 @@ VR_pred1(double *x, Sint *vars, char **lsplit, char **rsplit,
     }
 }
 
-static int nobs, nnode, *left, *right;
-static double *lprob, *where;
-static double *x;
-static char **lsplit, **rsplit;
-static Sint *vars, *nlevels, *nodes;
+/* Prediction works on blocks of PBLOCK rows together, moving every row
+   of the block down one level at a time with no data-dependent branches.
+   Leaves and factor splits have cut NaN, so that both comparisons fail
+   and the row stays put, as it does for a missing value; rows at factor
+   splits are then moved by a separate scalar pass. */
+#define PBLOCK 256
 
-static void 
-downtree(int i, int cur, double prob)
-    {
-	int     k, ival, cnode, var;
-	double   goleft;
-	double  val, sp;
-	if (cur >= nnode) PROBLEM "corrupt tree" RECOVER(NULL_ENTRY);
-	where[cur + nnode * i] += prob;
-	if (vars[cur] == 0)		/* at a leaf */
-	    return;
-	var = vars[cur] - 1;		/* C indexing */
-	val = x[i + nobs * var];
-#ifdef USING_R
-	if (ISNA(val)) {
-#else
-	if (is_na(&val, DOUBLE)) {
+/* If xf is not NULL the data are single precision, NaN if missing, and
+   x is ignored; the floats are compared with the (double) cuts.  If
+   single, double data are rounded to single precision to compare them
+   in the same way */
+typedef struct {
+    int nnode, nw, depth, nfac, single, *col, *left, *right, *fac;
+    Sint *var;
+    double *cut, *lprob;
+    float *xf;
+    unsigned int *lm, *rm;
+} CTree;
+
+#define XVAL(ct, x, k) ((ct)->xf ? (double) (ct)->xf[k] : (x)[k])
+
+static void step_scalar(CTree *ct, double *x, int nobs, int i0, int nb,
+			int *cur)
+{
+    int r, c, lt, ge;
+    double val, cut;
+
+    for (r = 0; r < nb; r++) {
+	c = cur[r];
+	val = XVAL(ct, x, i0 + r + (size_t) nobs * ct->col[c]);
+	cut = ct->cut[c];
+	lt = val < cut;
+	ge = val >= cut;
+	cur[r] = c + lt * (ct->left[c] - c) + ge * (ct->right[c] - c);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && !defined(NO_AVX2)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+
+/* step_scalar() on four rows at a time, using gathers */
+__attribute__((target("avx2")))
+static void step_avx2(CTree *ct, double *x, int nobs, int i0, int nb,
+		      int *cur)
+{
+    int r;
+    const __m256i pick = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0),
+	stride = _mm256_set1_epi64x(nobs);
+    __m128i c, col, l, rt, lt, ge;
+    __m256i off;
+    __m256d cut, val;
+
+    for (r = 0; r + 4 <= nb; r += 4) {
+	c = _mm_loadu_si128((__m128i *) (cur + r));
+	col = _mm_i32gather_epi32(ct->col, c, 4);
+	l = _mm_i32gather_epi32(ct->left, c, 4);
+	rt = _mm_i32gather_epi32(ct->right, c, 4);
+	cut = _mm256_i32gather_pd(ct->cut, c, 8);
+	off = _mm256_add_epi64(_mm256_mul_epi32(_mm256_cvtepi32_epi64(col),
+						stride),
+			       _mm256_setr_epi64x(i0 + r, i0 + r + 1,
+						  i0 + r + 2, i0 + r + 3));
+	if (ct->xf) val = _mm256_cvtps_pd(_mm256_i64gather_ps(ct->xf, off, 4));
+	else val = _mm256_i64gather_pd(x, off, 8);
+	lt = _mm256_castsi256_si128(
+	    _mm256_permutevar8x32_epi32(
+		_mm256_castpd_si256(_mm256_cmp_pd(val, cut, _CMP_LT_OQ)), pick));
+	ge = _mm256_castsi256_si128(
+	    _mm256_permutevar8x32_epi32(
+		_mm256_castpd_si256(_mm256_cmp_pd(val, cut, _CMP_GE_OQ)), pick));
+	c = _mm_blendv_epi8(c, l, lt);
+	c = _mm_blendv_epi8(c, rt, ge);
+	_mm_storeu_si128((__m128i *) (cur + r), c);
+    }
+    if (r < nb) step_scalar(ct, x, nobs, i0 + r, nb - r, cur + r);
+}
 #endif
-	    goleft = lprob[cur];
+
+/* move the rows at factor splits whose level is known to the split */
+static void step_factor(CTree *ct, double *x, int nobs, int i0, int nb,
+			int *cur)
+{
+    int r, c, l, nw = ct->nw;
+    double val;
+
+    for (r = 0; r < nb; r++) {
+	c = cur[r];
+	if (!ct->fac[c]) continue;
+	val = XVAL(ct, x, i0 + r + (size_t) nobs * ct->col[c]);
+	if (ISNAN(val)) continue;
+	l = (int) val - 1;
+	if (l < 0 || l >= 32 * nw) continue;
+	if (ct->lm[c * nw + l / 32] >> (l % 32) & 1) cur[r] = ct->left[c];
+	else if (ct->rm[c * nw + l / 32] >> (l % 32) & 1) cur[r] = ct->right[c];
+    }
+}
+
+/* Set up ct from the compiled form of the tree made by compile.tree():
+   var, the child indices left and right (C indexed, -1 at a leaf), cut
+   for continuous splits and for factor splits nw-word bitmasks of the
+   levels going left and right */
+static void
+ctree_init(CTree *ct, Sint *vars, Sint *left, Sint *right, double *cut,
+	   Sint *lmask, Sint *rmask, int nw, Sint *nlevels, int nnode)
+{
+    int i, *depth;
+
+    ct->nnode = nnode;
+    ct->nw = nw;
+    ct->var = vars;
+    ct->lm = (unsigned int *) lmask;
+    ct->rm = (unsigned int *) rmask;
+    ct->left = left;
+    ct->right = right;
+    ct->col = Salloc(nnode, int);
+    ct->fac = Salloc(nnode, int);
+    ct->cut = Salloc(nnode, double);
+    ct->lprob = NULL;
+    ct->xf = NULL;
+    ct->single = False;
+    depth = Salloc(nnode, int);
+    ct->depth = ct->nfac = 0;
+    for (i = 0; i < nnode; i++) {
+	ct->cut[i] = R_NaN;
+	if (vars[i] == 0) continue;
+	/* children follow their parent, which gives the depths */
+	if (left[i] <= i || right[i] <= i || left[i] >= nnode ||
+	    right[i] >= nnode)
+	    PROBLEM "corrupt tree" RECOVER(NULL_ENTRY);
+	depth[left[i]] = depth[right[i]] = depth[i] + 1;
+	ct->depth = max(ct->depth, depth[i] + 1);
+	ct->col[i] = vars[i] - 1;
+	if (nlevels[ct->col[i]]) {
+	    ct->fac[i] = True;
+	    ct->nfac++;
+	} else ct->cut[i] = cut[i];
+    }
+}
+
+/* As VR_pred1, but on the compiled tree.  Unlike VR_pred1, NaN is
+   treated as missing.  The blocks are shared among nthreads threads.
+   If *pfloat, x holds single-precision values (from tree.single()),
+   which halves the memory traffic of the traversal. */
+
+void
+VR_pred3(double *x, Sint *pnobs, Sint *vars, Sint *left, Sint *right,
+	 double *cut, Sint *lmask, Sint *rmask, Sint *pnw, Sint *nlevels,
+	 Sint *pnnode, Sint *pnthreads, Sint *where, Sint *pfloat)
+{
+    int     nobs = *pnobs, i0;
+    CTree   ct;
+    void  (*step)(CTree *, double *, int, int, int, int *) = step_scalar;
+
+    ctree_init(&ct, vars, left, right, cut, lmask, rmask, *pnw, nlevels,
+	       *pnnode);
+    if (*pfloat) ct.xf = (float *) x;
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) step = step_avx2;
+#endif
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(*pnthreads) schedule(static) \
+    if(*pnthreads > 1 && nobs > PBLOCK)
+#endif
+    for (i0 = 0; i0 < nobs; i0 += PBLOCK) {
+	int i, d, nb = min(PBLOCK, nobs - i0), cur[PBLOCK];
+
+	for (i = 0; i < nb; i++) cur[i] = 0;
+	for (d = 0; d < ct.depth; d++) {
+	    step(&ct, x, nobs, i0, nb, cur);
+	    if (ct.nfac) step_factor(&ct, x, nobs, i0, nb, cur);
 	}
-	else if (nlevels[var] == 0) {
-	    sp = R_atof(lsplit[cur] + 1);
-	    goleft = (val < sp);
+	for (i = 0; i < nb; i++) where[i0 + i] = cur[i] + 1;
+    }
+}
+
+/* Drop case i down the tree, splitting it at a missing value or an
+   unforeseen level in the proportions lprob of the training cases.  The
+   leaves reached and their probabilities are put in leaf[] and prob[] if
+   these are not NULL.  Returns the number of leaves reached.  The
+   stack stk, pstk of pending nodes needs room for depth + 1 entries. */
+static int
+descend(CTree *ct, double *x, int nobs, int i, int *stk, double *pstk,
+	int *leaf, double *prob)
+{
+    int     c, l, nw = ct->nw, sp = 0, nl = 0;
+    double  val, pr, goleft;
+
+    stk[sp] = 0;
+    pstk[sp++] = 1.0;
+    while (sp > 0) {
+	c = stk[--sp];
+	pr = pstk[sp];
+	if (ct->var[c] == 0) {	/* at a leaf */
+	    if (leaf) {
+		leaf[nl] = c;
+		prob[nl] = pr;
+	    }
+	    nl++;
+	    continue;
 	}
+	val = x[i + (size_t) nobs * ct->col[c]];
+	if (ISNA(val)) goleft = ct->lprob[c];
+	else if (!ct->fac[c])
+	    goleft = (ct->single ? (double) (float) val : val) < ct->cut[c];
 	else {
-	    ival = 'a' + (int) val - 1;
-	    if (strchr(lsplit[cur], ival) != NULL)
-		goleft = True;
-	    else if (strchr(rsplit[cur], ival) != NULL)
-		goleft = False;
-	    else
-		goleft = lprob[cur];
+	    l = (int) val - 1;
+	    if (l < 0 || l >= 32 * nw) goleft = ct->lprob[c];
+	    else if (ct->lm[c * nw + l / 32] >> (l % 32) & 1) goleft = 1;
+	    else if (ct->rm[c * nw + l / 32] >> (l % 32) & 1) goleft = 0;
+	    else goleft = ct->lprob[c];	/* unforeseen level */
+	}
+	/* the right child is pushed first so that leaves come in order */
+	if (goleft < 1) {
+	    stk[sp] = ct->right[c];
+	    pstk[sp++] = pr * (1 - goleft);
 	}
-	cnode = nodes[cur];
 	if (goleft > 0) {
-	    for (k = cur + 1; k < nnode; k++)
-		if (nodes[k] == 2 * cnode)
-		    break;
-	    downtree(i, k, prob * goleft);
+	    stk[sp] = ct->left[c];
+	    pstk[sp++] = pr * goleft;
 	}
-	if (goleft < 1) {
-	    for (k = cur + 1; k < nnode; k++)
-		if (nodes[k] == 2 * cnode + 1)
-		    break;
-	    downtree(i, k, prob * (1 - goleft));
+    }
+    return nl;
+}
+
+/* For predict(split = TRUE) and predict(type = "leaves"): a list of the
+   leaves each case reaches (1-based), with the probabilities, case i
+   having entries p[i] to p[i+1] - 1.  fn is the number of training cases
+   at each node.  If single, x is compared in single precision as by
+   VR_pred3. */
+SEXP
+VR_pred4(SEXP sx, SEXP svar, SEXP sleft, SEXP sright, SEXP scut,
+	 SEXP slmask, SEXP srmask, SEXP snlevels, SEXP sfn, SEXP ssingle,
+	 SEXP snthreads)
+{
+    int     nobs = INTEGER(getAttrib(sx, R_DimSymbol))[0], i, k,
+	nnode = LENGTH(svar), nthreads = asInteger(snthreads),
+	*fn = INTEGER(sfn), *stk, *p, *leaf = NULL;
+    double  *x = REAL(sx), *pstk, *prob = NULL;
+    CTree   ct;
+    SEXP    ans, nms;
+
+    ctree_init(&ct, INTEGER(svar), INTEGER(sleft), INTEGER(sright),
+	       REAL(scut), INTEGER(slmask), INTEGER(srmask),
+	       LENGTH(slmask) / nnode, INTEGER(snlevels), nnode);
+    ct.single = asLogical(ssingle) == TRUE;
+    ct.lprob = Salloc(nnode, double);
+    for (k = 0; k < nnode; k++)
+	if (ct.var[k] > 0)
+	    ct.lprob[k] = (double) fn[ct.left[k]] /
+		(fn[ct.left[k]] + fn[ct.right[k]]);
+    stk = Salloc((long) nthreads * (ct.depth + 1), int);
+    pstk = Salloc((long) nthreads * (ct.depth + 1), double);
+    /* count the leaves reached, then fill them in */
+    ans = PROTECT(allocVector(VECSXP, 3));
+    SET_VECTOR_ELT(ans, 0, allocVector(INTSXP, nobs + 1));
+    p = INTEGER(VECTOR_ELT(ans, 0));
+    for (k = 0; k < 2; k++) {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(static) \
+    if(nthreads > 1)
+#endif
+	for (i = 0; i < nobs; i++) {
+	    int th = 0, nl;
+#ifdef _OPENMP
+	    th = omp_get_thread_num();
+#endif
+	    nl = descend(&ct, x, nobs, i, stk + th * (ct.depth + 1),
+			 pstk + th * (ct.depth + 1),
+			 leaf ? leaf + p[i] : NULL, leaf ? prob + p[i] : NULL);
+	    if (!leaf) p[i + 1] = nl;
 	}
+	if (leaf) break;
+	p[0] = 0;
+	for (i = 0; i < nobs; i++) p[i + 1] += p[i];
+	SET_VECTOR_ELT(ans, 1, allocVector(INTSXP, p[nobs]));
+	SET_VECTOR_ELT(ans, 2, allocVector(REALSXP, p[nobs]));
+	leaf = INTEGER(VECTOR_ELT(ans, 1));
+	prob = REAL(VECTOR_ELT(ans, 2));
     }
+    for (k = 0; k < p[nobs]; k++) leaf[k]++;
+    nms = PROTECT(allocVector(STRSXP, 3));
+    SET_STRING_ELT(nms, 0, mkChar("p"));
+    SET_STRING_ELT(nms, 1, mkChar("leaf"));
+    SET_STRING_ELT(nms, 2, mkChar("prob"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(2);
+    return ans;
+}
 
-void    
-VR_pred2(double *px, Sint *pvars, char **plsplit, char **prsplit,
-	 Sint *pnlevels, Sint *pnodes, Sint *fn, Sint *pnnode,
-	 Sint *nr, double *pwhere)
-    {
-	int     cnode, i, k;
-
-	nobs = *nr;
-	nnode = *pnnode;
-	x = px;
-	vars = pvars;
-	lsplit = plsplit;
-	rsplit = prsplit;
-	nlevels = pnlevels;
-	nodes = pnodes;
-	where = pwhere;
-	lprob = Salloc((long)nnode, double);
-	left = Salloc((long)nnode, int);
-	right = Salloc((long)nnode, int);
-	for (i = 0; i < nnode; i++)
-	    if (vars[i] > 0) {
-		cnode = nodes[i];
-		for (k = i + 1; k < nnode; k++) {
-		    if (nodes[k] == 2 * cnode) left[i] = k;
-		    if (nodes[k] == 2 * cnode + 1) right[i] = k;
-		}
-		lprob[i] = (double)fn[left[i]] / (fn[left[i]] + fn[right[i]]);
+
+
+static SEXP list_elt(SEXP list, const char *nm)
+{
+    int     i;
+    SEXP    names = getAttrib(list, R_NamesSymbol);
+
+    for (i = 0; i < LENGTH(list); i++)
+	if (!strcmp(CHAR(STRING_ELT(names, i)), nm))
+	    return VECTOR_ELT(list, i);
+    error("no component '%s'", nm);
+    return R_NilValue;
+}
+
+/* The mean (or if sum, the sum) over an ensemble of compiled trees
+   (lists with var, left, right, cut, lmask, rmask and yval, or yprob if
+   there are nc > 0 classes) of the value at the node each case reaches:
+   a vector, or a cases x classes matrix.  Each block of cases goes down
+   every tree in turn as in VR_pred3, and the blocks are shared among
+   nthreads threads. */
+SEXP
+VR_predens(SEXP sx, SEXP strees, SEXP snlevels, SEXP snc, SEXP ssum,
+	   SEXP snthreads)
+{
+    int     nobs = INTEGER(getAttrib(sx, R_DimSymbol))[0],
+	ntree = LENGTH(strees), nc = asInteger(snc),
+	nv = max(nc, 1), b, i, i0, nnode;
+    double  *x = REAL(sx), *a, **val;
+    CTree   *ct;
+    SEXP    ans, tr, lm;
+    void  (*step)(CTree *, double *, int, int, int, int *) = step_scalar;
+#ifdef _OPENMP
+    int     nthreads = asInteger(snthreads);
+#endif
+
+    ct = (CTree *) R_alloc(ntree, sizeof(CTree));
+    val = (double **) R_alloc(ntree, sizeof(double *));
+    for (b = 0; b < ntree; b++) {
+	tr = VECTOR_ELT(strees, b);
+	nnode = LENGTH(list_elt(tr, "var"));
+	lm = list_elt(tr, "lmask");
+	ctree_init(ct + b, INTEGER(list_elt(tr, "var")),
+		   INTEGER(list_elt(tr, "left")),
+		   INTEGER(list_elt(tr, "right")), REAL(list_elt(tr, "cut")),
+		   INTEGER(lm), INTEGER(list_elt(tr, "rmask")),
+		   LENGTH(lm) / nnode, INTEGER(snlevels), nnode);
+	val[b] = REAL(list_elt(tr, nc ? "yprob" : "yval"));
+    }
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) step = step_avx2;
+#endif
+    ans = PROTECT(nc ? allocMatrix(REALSXP, nobs, nc)
+		  : allocVector(REALSXP, nobs));
+    a = REAL(ans);
+    for (i = 0; i < nobs * nv; i++) a[i] = 0.0;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(static) \
+    if(nthreads > 1 && nobs > PBLOCK)
+#endif
+    for (i0 = 0; i0 < nobs; i0 += PBLOCK) {
+	int r, d, k, t, nb = min(PBLOCK, nobs - i0), cur[PBLOCK];
+
+	for (t = 0; t < ntree; t++) {
+	    for (r = 0; r < nb; r++) cur[r] = 0;
+	    for (d = 0; d < ct[t].depth; d++) {
+		step(ct + t, x, nobs, i0, nb, cur);
+		if (ct[t].nfac) step_factor(ct + t, x, nobs, i0, nb, cur);
 	    }
+	    for (k = 0; k < nv; k++)
+		for (r = 0; r < nb; r++)
+		    a[i0 + r + (size_t) nobs * k] +=
+			val[t][cur[r] + ct[t].nnode * k];
+	}
+    }
+    if (!asLogical(ssum))
+	for (i = 0; i < nobs * nv; i++) a[i] /= ntree;
+    UNPROTECT(1);
+    return ans;
+}
 
-	for (i = 0; i < nobs; i++) {
-	    for (k = 0; k < nnode; k++) where[k + nnode * i] = 0.0;
-	    downtree(i, 0, 1.0);
+/* Prediction from a tree mapped by VR_treemap() for the nobs cases of
+   x, single-precision values if the tree is traversed that way: type 0
+   the node each case reaches (1-based), 1 its yval, or for a
+   classification tree its yprob as a cases x classes matrix, and 2 the
+   class code (its yval).  As VR_pred3, cases stop at a split on a
+   missing value. */
+SEXP
+VR_predmap(SEXP sptr, SEXP sx, SEXP snobs, SEXP stype, SEXP snthreads)
+{
+    int     nobs = asInteger(snobs), type = asInteger(stype),
+	i0, nv, *iw = NULL;
+    double  *x, *a = NULL;
+    TreeModel tm;
+    CTree   ct;
+    SEXP    ans;
+    void  (*step)(CTree *, double *, int, int, int, int *) = step_scalar;
+#ifdef _OPENMP
+    int     nthreads = asInteger(snthreads);
+#endif
+
+    tree_model(sptr, &tm);
+    if (tm.single ? TYPEOF(sx) != RAWSXP ||
+	XLENGTH(sx) != 4 * (R_xlen_t) nobs * tm.nvar
+	: TYPEOF(sx) != REALSXP || XLENGTH(sx) != (R_xlen_t) nobs * tm.nvar)
+	error("invalid data for the tree model");
+    x = tm.single ? (double *) RAW(sx) : REAL(sx);
+    ctree_init(&ct, tm.var, tm.left, tm.right, tm.cut, tm.lmask, tm.rmask,
+	       tm.nw, tm.nlevels, tm.nnode);
+    if (tm.single) ct.xf = (float *) x;
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) step = step_avx2;
+#endif
+    nv = (type == 1 && tm.nc) ? tm.nc : 1;
+    ans = PROTECT(type == 1 ? (tm.nc ? allocMatrix(REALSXP, nobs, nv)
+			       : allocVector(REALSXP, nobs))
+		  : allocVector(INTSXP, nobs));
+    if (type == 1) a = REAL(ans);
+    else iw = INTEGER(ans);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(static) \
+    if(nthreads > 1 && nobs > PBLOCK)
+#endif
+    for (i0 = 0; i0 < nobs; i0 += PBLOCK) {
+	int r, d, k, nb = min(PBLOCK, nobs - i0), cur[PBLOCK];
+
+	for (r = 0; r < nb; r++) cur[r] = 0;
+	for (d = 0; d < ct.depth; d++) {
+	    step(&ct, x, nobs, i0, nb, cur);
+	    if (ct.nfac) step_factor(&ct, x, nobs, i0, nb, cur);
 	}
+	if (type == 0)
+	    for (r = 0; r < nb; r++) iw[i0 + r] = cur[r] + 1;
+	else if (type == 2)
+	    for (r = 0; r < nb; r++) iw[i0 + r] = (int) tm.yval[cur[r]];
+	else if (!tm.nc)
+	    for (r = 0; r < nb; r++) a[i0 + r] = tm.yval[cur[r]];
+	else
+	    for (k = 0; k < nv; k++)
+		for (r = 0; r < nb; r++)
+		    a[i0 + r + (size_t) nobs * k] =
+			tm.yprob[cur[r] + (size_t) tm.nnode * k];
     }
+    UNPROTECT(1);
+    return ans;
+}
+
+/* Cross-validation of the pruning sequence, as cv.tree() with
+   prune.tree() or prune.misclass().  For each fold f = 1 ... nfold a
+   tree is grown as tree() does from the cases with fold[j] != f, and
+   the deviance on the cases with fold[j] == f (with unit weights) of its
+   subtree for each of the k[] is added into cvdev.  method is 0 for
+   deviance and 1 for misclassification.  The folds are shared among
+   nthreads threads, each tree being grown on one, so all storage here
+   is malloc-ed. */
+
+typedef struct {
+    double *X, *y, *w, *loss, eps, mindev, *k;
+    Sint *levels, *ordered, *fold;
+    int nobs, nvar, nc, minsize, mincut, engine, nbins, fsplit, maxleaves,
+	maxdepth, method, nk;
+} CVData;
+
+/* calloc, remembering the block in mem[] (of CV_NMEM slots) to free */
+#define CV_NMEM 32
+
+static void *cv_alloc(void **mem, int *nmem, size_t n, size_t sz)
+{
+    void *p;
+
+    if (*nmem >= CV_NMEM) return NULL;
+    p = calloc(n > 0 ? n : 1, sz);
+    if (p) mem[(*nmem)++] = p;
+    return p;
+}
+
+/* the case at row j of X dropped down the tree as predict() does */
+static int cv_where(CVData *d, Tree *t, int j, Sint *left, Sint *right,
+		    double *cutr)
+{
+    int i = 0, iv, l;
+    double x;
+
+    while ((iv = t->var[i] - 1) >= 0) {
+	x = d->X[j + (size_t) d->nobs * iv];
+	if (d->levels[iv]) {
+	    if (ISNA(x)) break;
+	    l = (int) x - 1;
+	    if (l < 0 || l >= d->levels[iv]) break;
+	    if (t->lmask[i * t->nw + l / 32] >> (l % 32) & 1) i = left[i];
+	    else if (t->rmask[i * t->nw + l / 32] >> (l % 32) & 1) i = right[i];
+	    else break;
+	} else if (x < cutr[i]) i = left[i];
+	else if (x >= cutr[i]) i = right[i];
+	else break;
+    }
+    return i + 1;
+}
+
+/* the deviances of the subtrees for k[] on fold f into dk[nk] */
+static int cv_fold(CVData *d, int f, double *dk)
+{
+    Tree tr, *t = &tr;
+    void *mem[CV_NMEM];
+    int i, j, l, m, nr, na, ntr, nmem = 0, nc = d->nc, nw = max(nc, 1),
+	nmax, res, *ord, *nd, *parent, *left, *right, *yf, *leaf, *keep,
+	*size, *inodes, *tsize, *iw, *subset, *cy, *cwh;
+    double *dev, *sdev, *ndev, *nsdev, *yp, *cnt, *cutr, *g, *cdev, *alph,
+	*tdev, *ntdev, *dw, *cyd, *cw, *work, kk;
+    char buf[100];
+
+    memset(t, 0, sizeof(Tree));
+    subset = (int *) cv_alloc(mem, &nmem, d->nobs, sizeof(int));
+    if (!subset) return TREE_NOMEM;
+    for (ntr = 0, j = 0; j < d->nobs; j++)
+	if ((subset[j] = d->fold[j] != f)) ntr++;
+    /* as tree.control(ntr) */
+    nmax = (int) ceil((4.0 * ntr)/(d->minsize - 1));
+    t->X = d->X; t->y = d->y; t->w = d->w;
+    t->nobs = d->nobs; t->nvar = d->nvar;
+    t->levels = d->levels; t->ordered = d->ordered; t->subset = subset;
+    t->minsize = d->minsize; t->mincut = d->mincut; t->mindev = d->mindev;
+    t->nmax = nmax; t->Gini = 0;
+    t->engine = d->engine; t->nbins = d->nbins; t->fsplit = d->fsplit;
+    t->maxleaves = d->maxleaves; t->maxdepth = d->maxdepth;
+    t->nthreads = 1;
+    t->nnode = 0;
+    t->node = (Sint *) cv_alloc(mem, &nmem, nmax, sizeof(Sint));
+    t->var = (Sint *) cv_alloc(mem, &nmem, nmax, sizeof(Sint));
+    t->where = (Sint *) cv_alloc(mem, &nmem, d->nobs, sizeof(Sint));
+    t->n = (double *) cv_alloc(mem, &nmem, nmax, sizeof(double));
+    t->dev = (double *) cv_alloc(mem, &nmem, nmax, sizeof(double));
+    t->yval = (double *) cv_alloc(mem, &nmem, nmax, sizeof(double));
+    t->yprob = (double *) cv_alloc(mem, &nmem, nmax * nw, sizeof(double));
+    if (!t->node || !t->var || !t->where || !t->n || !t->dev ||
+	!t->yval || !t->yprob) res = TREE_NOMEM;
+    else res = tree_grow(t);
+    if (res != TREE_OK) goto done;
+    nr = t->nnode;
+    if (nr == 1) {
+	res = TREE_SINGLE;
+	goto done;
+    }
+
+    /* the cases, training then test */
+    cy = (int *) cv_alloc(mem, &nmem, d->nobs, sizeof(int));
+    cwh = (int *) cv_alloc(mem, &nmem, d->nobs, sizeof(int));
+    cyd = (double *) cv_alloc(mem, &nmem, d->nobs, sizeof(double));
+    cw = (double *) cv_alloc(mem, &nmem, d->nobs, sizeof(double));
+    iw = (int *) cv_alloc(mem, &nmem, 11 * nr + PRUNE_IW(nr), sizeof(int));
+    dw = (double *) cv_alloc(mem, &nmem, 13 * nr + 2 * nr * nw,
+			     sizeof(double));
+    if (!cy || !cwh || !cyd || !cw || !iw || !dw) {
+	res = TREE_NOMEM;
+	goto done;
+    }
+    ord = iw; nd = ord + nr; parent = nd + nr; left = parent + nr;
+    right = left + nr; yf = right + nr; leaf = yf + nr; keep = leaf + nr;
+    size = keep + nr; inodes = size + nr; tsize = inodes + nr;
+    dev = dw; sdev = dev + nr; ndev = sdev + nr; nsdev = ndev + nr;
+    cutr = nsdev + nr; g = cutr + nr; cdev = g + nr; alph = cdev + nr;
+    tdev = alph + nr; ntdev = tdev + nr; work = ntdev + nr;
+    yp = work + 3 * nr; cnt = yp + nr * nw;
+
+    topology(t->node, nr, parent, left, right, tsize + nr);
+    node_order(t->node, nr, ord, nd);
+    for (i = 0; i < nr; i++) {
+	yf[i] = (int) t->yval[i];
+	leaf[i] = t->var[i] == 0;
+	/* the cut as in the label, which is what predict() uses */
+	if (t->var[i] && !d->levels[t->var[i] - 1]) {
+	    snprintf(buf, 100, "%g", t->cut[i]);
+	    cutr[i] = strtod(buf, NULL);
+	}
+	for (l = 0; l < nc; l++) yp[i + nr * l] = t->yprob[i * nc + l];
+    }
+    for (i = 0, m = ntr, j = 0; j < d->nobs; j++) {
+	l = subset[j] ? i++ : m++;
+	cyd[l] = d->y[j];
+	cy[l] = (int) d->y[j];
+	if (subset[j]) {
+	    cw[l] = d->w[j];
+	    cwh[l] = t->where[j];
+	} else {
+	    cw[l] = 1.0;
+	    cwh[l] = cv_where(d, t, j, left, right, cutr);
+	}
+    }
+
+    /* as prune.tree(, newdata = ) */
+    if (d->method == 1) {
+	dev_loss(nr, parent, ord, dev, sdev, cy, ntr, yf, cwh, cw, nc,
+		 d->loss, cnt);
+	dev_loss(nr, parent, ord, ndev, nsdev, cy + ntr, d->nobs - ntr, yf,
+		 cwh + ntr, cw + ntr, nc, d->loss, cnt);
+    } else if (nc) {
+	for (i = 0; i < nr; i++) dev[i] = t->dev[i];
+	dev_logp(nr, parent, ord, ndev, sdev, cy, ntr, yp, cwh, cw, nc, cnt);
+	for (i = 0; i < nr; i++) sdev[i] *= -2;
+	for (i = 0; i < nr * nc; i++) if (yp[i] == 0) yp[i] = max(0, d->eps);
+	dev_logp(nr, parent, ord, ndev, nsdev, cy + ntr, d->nobs - ntr, yp,
+		 cwh + ntr, cw + ntr, nc, cnt);
+	for (i = 0; i < nr; i++) {
+	    ndev[i] *= -2;
+	    nsdev[i] *= -2;
+	}
+    } else {
+	for (i = 0; i < nr; i++) dev[i] = t->dev[i];
+	dev_sq(nr, parent, ord, ndev, sdev, cyd, ntr, t->yval, cwh, cw, work);
+	dev_sq(nr, parent, ord, ndev, nsdev, cyd + ntr, d->nobs - ntr,
+	       t->yval, cwh + ntr, cw + ntr, work);
+    }
+    for (i = 0; i < nr; i++) ord[i]++;
+    na = prune_seq(nr, t->node, leaf, dev, sdev, ndev, nsdev, keep, ord, g,
+		   size, cdev, alph, inodes, tsize, tdev, ntdev,
+		   tsize + nr, work);
+    for (m = 0; m < d->nk; m++) {
+	kk = max(d->k[m], -1e+100);
+	for (l = 0, i = 0; i < na; i++) if (kk >= alph[i]) l++;
+	dk[m] = ntdev[l - 1];
+    }
+
+done:
+    tree_free(t);
+    for (i = 0; i < nmem; i++) free(mem[i]);
+    return res;
+}
+
+void
+VR_cvtree(double *X, double *y, double *w, Sint *levels, Sint *ordered,
+	  Sint *pnobs, Sint *pnvar, Sint *fold, Sint *pnfold, Sint *pminsize,
+	  Sint *pmincut, double *pmindev, Sint *pctrl, Sint *pmethod,
+	  double *loss, double *peps, double *k, Sint *pnk, double *cvdev)
+{
+    CVData d;
+    int f, m, nfold = *pnfold, nk = *pnk, *res;
+#ifdef _OPENMP
+    int nthreads = max(pctrl[2], 1);
+#endif
+    double *dk;
+
+    d.X = X; d.y = y; d.w = w; d.loss = loss; d.eps = *peps;
+    d.mindev = *pmindev; d.k = k;
+    d.levels = levels; d.ordered = ordered; d.fold = fold;
+    d.nobs = *pnobs; d.nvar = *pnvar; d.nc = levels[*pnvar];
+    d.minsize = *pminsize; d.mincut = *pmincut;
+    d.engine = pctrl[0]; d.nbins = pctrl[1]; d.fsplit = pctrl[3];
+    d.maxleaves = pctrl[4]; d.maxdepth = pctrl[5];
+    d.method = *pmethod; d.nk = nk;
+    res = Salloc(nfold, int);
+    dk = Salloc((size_t) nfold * nk, double);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) \
+    if(nthreads > 1 && nfold > 1)
+#endif
+    for (f = 0; f < nfold; f++)
+	res[f] = cv_fold(&d, f + 1, dk + (size_t) f * nk);
+    for (f = 0; f < nfold; f++)
+	if (res[f] != TREE_OK) error("%s", tree_errmsg(res[f]));
+    /* in the order of the folds, as cv.tree() adds them */
+    for (m = 0; m < nk; m++) {
+	cvdev[m] = 0.0;
+	for (f = 0; f < nfold; f++) cvdev[m] += dk[m + (size_t) f * nk];
+    }
+}
@@ -0,0 +1,379 @@
+/*
+ *  tree/src/treeio.c  Copyright (C) 2026 the authors of package 'tree'
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 or 3 of the License
+ *  (at your option).
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  A copy of the GNU General Public License is available at
+ *  http://www.r-project.org/Licenses/
+ */
+
+/* A binary form of a compiled tree, written by tree.write() and mapped
+   into memory by tree.map(), so that it can be used for prediction
+   without being made into R objects.
+
+   The file is a 64-byte header followed by, each part starting on an
+   8-byte boundary, cut, yval and for nc classes the nnode x nc matrix
+   yprob as doubles, then var, left, right, the nw-word level masks
+   lmask and rmask of each node and the numbers of levels of the nvar
+   variables as 32-bit integers, and last the strings, each ending in a
+   nul: the nvar variable names, the levels of each factor and the nc
+   class levels.  The checksum is the 64-bit FNV-1a hash of everything
+   after the header.  Numbers are in the byte order of the machine that
+   wrote the file, which is checked by the endian mark. */
+
+#include <stddef.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <R.h>
+#include <Rinternals.h>
+#include "tree.h"
+
+#ifdef _WIN32
+# define NO_MMAP
+#endif
+#ifndef NO_MMAP
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#ifdef ENABLE_NLS
+#include <libintl.h>
+#define _(String) dgettext ("tree", String)
+#else
+#define _(String) (String)
+#endif
+
+#define TM_VERSION 1
+#define TM_ENDIAN 0x01020304u
+#define TM_NPART 10
+
+static const char tm_magic[8] = {'R', 't', 'r', 'e', 'e', 'B', 'i', 'n'};
+
+typedef struct {
+    char magic[8];
+    uint32_t version, endian;
+    int32_t nnode, nvar, nw, nc, single, pad;
+    uint64_t size, nstr, check;
+} TMHeader;
+
+/* a mapped (or, without mmap, read) file */
+typedef struct {
+    void *base;
+    size_t size;
+    int mapped;
+} TMap;
+
+static uint64_t fnv1a(const unsigned char *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	h ^= p[i];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* The offsets of the parts after the header, in the order above, and
+   the size of the file */
+static size_t tm_layout(const TMHeader *h, size_t *off)
+{
+    size_t n = h->nnode, len[TM_NPART], pos = sizeof(TMHeader);
+    int k;
+
+    len[0] = len[1] = n * sizeof(double);
+    len[2] = n * h->nc * sizeof(double);
+    len[3] = len[4] = len[5] = n * sizeof(int32_t);
+    len[6] = len[7] = n * h->nw * sizeof(int32_t);
+    len[8] = (size_t) h->nvar * sizeof(int32_t);
+    len[9] = h->nstr;
+    for (k = 0; k < TM_NPART; k++) {
+	off[k] = pos;
+	pos += (len[k] + 7) & ~(size_t) 7;
+    }
+    return pos;
+}
+
+/* Write the compiled tree as made by compile.tree(): var, left, right,
+   cut, lmask and rmask, with the numbers of levels nlevels, the fitted
+   values yval (class codes for a classification tree), yprob (of
+   length 0 for regression), the strings as described above, and
+   whether the tree is traversed in single precision */
+SEXP
+VR_treesave(SEXP sfile, SEXP svar, SEXP sleft, SEXP sright, SEXP scut,
+	    SEXP slmask, SEXP srmask, SEXP snlevels, SEXP syval, SEXP syprob,
+	    SEXP sstr, SEXP ssingle)
+{
+    TMHeader h;
+    size_t off[TM_NPART], size, n;
+    int i;
+    char *buf, *s;
+    const char *str;
+    FILE *fp;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, tm_magic, 8);
+    h.version = TM_VERSION;
+    h.endian = TM_ENDIAN;
+    h.nnode = LENGTH(svar);
+    h.nvar = LENGTH(snlevels);
+    h.nw = h.nnode ? LENGTH(slmask) / h.nnode : 1;
+    h.nc = h.nnode ? LENGTH(syprob) / h.nnode : 0;
+    h.single = asLogical(ssingle) == TRUE;
+    for (i = 0; i < LENGTH(sstr); i++)
+	h.nstr += strlen(translateCharUTF8(STRING_ELT(sstr, i))) + 1;
+    size = tm_layout(&h, off);
+    h.size = size;
+
+    n = h.nnode;
+    buf = R_alloc(size, 1);
+    memset(buf, 0, size);
+    memcpy(buf + off[0], REAL(scut), n * sizeof(double));
+    memcpy(buf + off[1], REAL(syval), n * sizeof(double));
+    memcpy(buf + off[2], REAL(syprob), n * h.nc * sizeof(double));
+    memcpy(buf + off[3], INTEGER(svar), n * sizeof(int32_t));
+    memcpy(buf + off[4], INTEGER(sleft), n * sizeof(int32_t));
+    memcpy(buf + off[5], INTEGER(sright), n * sizeof(int32_t));
+    memcpy(buf + off[6], INTEGER(slmask), n * h.nw * sizeof(int32_t));
+    memcpy(buf + off[7], INTEGER(srmask), n * h.nw * sizeof(int32_t));
+    memcpy(buf + off[8], INTEGER(snlevels), h.nvar * sizeof(int32_t));
+    for (s = buf + off[9], i = 0; i < LENGTH(sstr); i++) {
+	str = translateCharUTF8(STRING_ELT(sstr, i));
+	strcpy(s, str);
+	s += strlen(str) + 1;
+    }
+    h.check = fnv1a((unsigned char *) buf + sizeof(TMHeader),
+		    size - sizeof(TMHeader));
+    memcpy(buf, &h, sizeof(TMHeader));
+
+    fp = fopen(R_ExpandFileName(translateChar(STRING_ELT(sfile, 0))), "wb");
+    if (!fp) error(_("cannot open file '%s'"),
+		   translateChar(STRING_ELT(sfile, 0)));
+    n = fwrite(buf, 1, size, fp);
+    if (fclose(fp) != 0 || n != size)
+	error(_("error writing file '%s'"),
+	      translateChar(STRING_ELT(sfile, 0)));
+    return R_NilValue;
+}
+
+static void tm_unmap(TMap *m)
+{
+    if (!m->base) return;
+#ifndef NO_MMAP
+    if (m->mapped) munmap(m->base, m->size);
+    else
+#endif
+	free(m->base);
+    m->base = NULL;
+}
+
+static void tm_finalize(SEXP sptr)
+{
+    TMap *m = (TMap *) R_ExternalPtrAddr(sptr);
+
+    if (!m) return;
+    tm_unmap(m);
+    free(m);
+    R_ClearExternalPtr(sptr);
+}
+
+/* Check the header and the tree of the file in m, and its checksum if
+   verify: returns NULL or the reason it is not valid */
+static const char *tm_check(TMap *m, int verify)
+{
+    TMHeader h;
+    size_t off[TM_NPART];
+    int32_t *var, *left, *right;
+    int i;
+
+    if (m->size < sizeof(TMHeader)) return _("file is too short");
+    memcpy(&h, m->base, sizeof(TMHeader));
+    if (memcmp(h.magic, tm_magic, 8)) return _("not a tree model file");
+    if (h.endian != TM_ENDIAN)
+	return _("file was written with a different byte order");
+    if (h.version != TM_VERSION)
+	return _("unsupported version of tree model file");
+    if (h.nnode < 1 || h.nvar < 1 || h.nw < 1 || h.nc < 0 ||
+	h.nnode > INT_MAX / 32 || h.nw > 1024 || h.nc > 65536 ||
+	h.nstr > m->size)
+	return _("corrupt tree model file");
+    if (tm_layout(&h, off) != m->size || h.size != m->size)
+	return _("tree model file has the wrong size");
+    if (verify && fnv1a((unsigned char *) m->base + sizeof(TMHeader),
+			m->size - sizeof(TMHeader)) != h.check)
+	return _("checksum of tree model file does not match");
+    var = (int32_t *) ((char *) m->base + off[3]);
+    left = (int32_t *) ((char *) m->base + off[4]);
+    right = (int32_t *) ((char *) m->base + off[5]);
+    for (i = 0; i < h.nnode; i++) {
+	if (var[i] < 0 || var[i] > h.nvar) return _("corrupt tree model file");
+	/* children follow their parent */
+	if (var[i] && (left[i] <= i || right[i] <= i ||
+		       left[i] >= h.nnode || right[i] >= h.nnode))
+	    return _("corrupt tree model file");
+    }
+    if (h.nstr && ((char *) m->base)[off[9] + h.nstr - 1])
+	return _("corrupt tree model file");
+    return NULL;
+}
+
+/* Map the file into memory, as an external pointer that unmaps it when
+   collected */
+SEXP
+VR_treemap(SEXP sfile, SEXP sverify)
+{
+    const char *fn = R_ExpandFileName(translateChar(STRING_ELT(sfile, 0))),
+	*msg;
+    TMap *m = (TMap *) calloc(1, sizeof(TMap));
+    SEXP ans;
+#ifndef NO_MMAP
+    struct stat st;
+    int fd;
+#else
+    FILE *fp;
+    long len;
+#endif
+
+    if (!m) error(_("out of memory"));
+#ifndef NO_MMAP
+    fd = open(fn, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	if (fd >= 0) close(fd);
+	free(m);
+	error(_("cannot open file '%s'"), fn);
+    }
+    m->size = st.st_size;
+    if (m->size > 0) {
+	m->base = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m->base == MAP_FAILED) m->base = NULL;
+	m->mapped = 1;
+    }
+    close(fd);
+#else
+    fp = fopen(fn, "rb");
+    if (!fp) {
+	free(m);
+	error(_("cannot open file '%s'"), fn);
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    m->size = len > 0 ? len : 0;
+    if (m->size > 0 && (m->base = malloc(m->size)) &&
+	fread(m->base, 1, m->size, fp) != m->size) {
+	free(m->base);
+	m->base = NULL;
+    }
+    fclose(fp);
+#endif
+    if (m->size > 0 && !m->base) {
+	free(m);
+	error(_("cannot map file '%s'"), fn);
+    }
+    if ((msg = tm_check(m, asLogical(sverify) != FALSE))) {
+	tm_unmap(m);
+	free(m);
+	error("%s: '%s'", msg, fn);
+    }
+    ans = PROTECT(R_MakeExternalPtr(m, install("tree.map"), R_NilValue));
+    R_RegisterCFinalizerEx(ans, tm_finalize, TRUE);
+    UNPROTECT(1);
+    return ans;
+}
+
+/* point tm into the mapped file of sptr */
+void tree_model(SEXP sptr, TreeModel *tm)
+{
+    TMap *m;
+    TMHeader *h;
+    size_t off[TM_NPART];
+    char *b;
+
+    if (TYPEOF(sptr) != EXTPTRSXP ||
+	!(m = (TMap *) R_ExternalPtrAddr(sptr)) || !m->base)
+	error(_("the tree model is no longer mapped: use tree.map() again"));
+    b = (char *) m->base;
+    h = (TMHeader *) b;
+    tm_layout(h, off);
+    tm->nnode = h->nnode;
+    tm->nvar = h->nvar;
+    tm->nw = h->nw;
+    tm->nc = h->nc;
+    tm->single = h->single;
+    tm->cut = (double *) (b + off[0]);
+    tm->yval = (double *) (b + off[1]);
+    tm->yprob = (double *) (b + off[2]);
+    tm->var = (Sint *) (b + off[3]);
+    tm->left = (Sint *) (b + off[4]);
+    tm->right = (Sint *) (b + off[5]);
+    tm->lmask = (Sint *) (b + off[6]);
+    tm->rmask = (Sint *) (b + off[7]);
+    tm->nlevels = (Sint *) (b + off[8]);
+    tm->str = b + off[9];
+    tm->nstr = h->nstr;
+}
+
+/* The variable names, their levels (NULL if continuous) and the class
+   levels of the mapped tree, and whether it is traversed in single
+   precision */
+SEXP
+VR_treeinfo(SEXP sptr)
+{
+    TreeModel tm;
+    const char *s, *end;
+    int i, k, nl;
+    SEXP ans, nms, xlev, lev;
+
+    tree_model(sptr, &tm);
+    s = tm.str;
+    end = tm.str + tm.nstr;
+    ans = PROTECT(allocVector(VECSXP, 5));
+    nms = allocVector(STRSXP, tm.nvar);
+    SET_VECTOR_ELT(ans, 0, nms);
+    for (i = 0; i < tm.nvar; i++) {
+	if (s >= end) error(_("corrupt tree model file"));
+	SET_STRING_ELT(nms, i, mkCharCE(s, CE_UTF8));
+	s += strlen(s) + 1;
+    }
+    xlev = allocVector(VECSXP, tm.nvar);
+    SET_VECTOR_ELT(ans, 1, xlev);
+    setAttrib(xlev, R_NamesSymbol, nms);
+    for (i = 0; i <= tm.nvar; i++) {
+	nl = (i < tm.nvar) ? tm.nlevels[i] : tm.nc;
+	if (!nl) continue;
+	lev = allocVector(STRSXP, nl);
+	if (i < tm.nvar) SET_VECTOR_ELT(xlev, i, lev);
+	else SET_VECTOR_ELT(ans, 2, lev);
+	for (k = 0; k < nl; k++) {
+	    if (s >= end) error(_("corrupt tree model file"));
+	    SET_STRING_ELT(lev, k, mkCharCE(s, CE_UTF8));
+	    s += strlen(s) + 1;
+	}
+    }
+    SET_VECTOR_ELT(ans, 3, ScalarInteger(tm.nnode));
+    SET_VECTOR_ELT(ans, 4, ScalarLogical(tm.single));
+    nms = PROTECT(allocVector(STRSXP, 5));
+    SET_STRING_ELT(nms, 0, mkChar("names"));
+    SET_STRING_ELT(nms, 1, mkChar("xlevels"));
+    SET_STRING_ELT(nms, 2, mkChar("ylevels"));
+    SET_STRING_ELT(nms, 3, mkChar("nnode"));
+    SET_STRING_ELT(nms, 4, mkChar("single"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    UNPROTECT(2);
+    return ans;
+}